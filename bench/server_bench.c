@@ -0,0 +1,359 @@
+/*
+//   Program:             TBD Chat Server Benchmarks
+//   File Name:           server_bench.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "../server/chat_server.h"
+
+/*
+ *Micro-benchmarks of the server's hot path.  Each benchmark prints one JSON
+ *object per line on stdout,
+ *
+ *   {"bench":"get_user","variant":"indexed","n":10000,"ops":100000,"ns_per_op":41.2}
+ *
+ *so runs can be diffed or loaded into anything.  The server's own chatter is
+ *sent to /dev/null and rooms write their logs and history under a scratch
+ *directory that is removed afterwards.  An optional argument picks the
+ *benchmarks whose name starts with it.
+ */
+#define BENCH_OPS 100000        // operations timed by most benchmarks
+#define BENCH_HASHES 20000      // password hashes timed
+#define BENCH_ROUNDS 2000       // room broadcasts timed, fewer for large rooms
+#define BENCH_DELIVERIES 200000 // member deliveries timed per room size
+#define BENCH_PLAIN_MAX 10000   // largest user list searched without an index
+
+// Globals the server modules expect from chat_server.c
+Listener *listeners;
+int num_listeners = 1;
+int numRooms = DEFAULT_ROOM;
+pthread_rwlock_t registered_users_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t active_users_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t rooms_lock = PTHREAD_RWLOCK_INITIALIZER;
+Node *registered_users_list;
+Node *active_users_list;
+Node *room_list;
+int outq_messages = OUTQ_MESSAGES;
+size_t outq_bytes = OUTQ_BYTES;
+int slow_policy = SLOW_DISCONNECT;
+ThreadPool client_pool;
+char const *server_MOTD = "Benchmark";
+
+static FILE *results;
+static char *only = "";
+static Node *indexed_list;
+static Node *plain_list;
+static pthread_rwlock_t bench_lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile int sink;               // results written here are never optimized away
+
+
+void debugPacket(packet *rx_pkt) { }
+void turn_away(int client) { close(client); }
+int get_server_socket(char *hostname, char *port, int reuseport) { return -1; }
+int start_server(int serv_socket, int backlog) { return -1; }
+int accept_client(int serv_sock, int flags) { return -1; }
+
+
+static double now_ns() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* Whether a benchmark was asked for */
+static int wanted(char *bench) {
+   return strncmp(bench, only, strlen(only)) == 0;
+}
+
+
+/* Print one result line */
+static void report(char *bench, char *variant, long n, long ops, double elapsed) {
+   fprintf(results, "{\"bench\":\"%s\",\"variant\":\"%s\",\"n\":%ld,\"ops\":%ld,\"ns_per_op\":%.1f}\n",
+           bench, variant, n, ops, elapsed / ops);
+   fflush(results);
+}
+
+
+/* Users named like registered accounts, with a hashed password */
+static User *make_users(long n) {
+   User *users = (User *)calloc(n, sizeof(User));
+   long i;
+
+   for (i = 0; i < n; i++) {
+      snprintf(users[i].username, USERNAME_LENGTH, "user%07ld", i * 7919 % 10000000);
+      strcpy(users[i].real_name, users[i].username);
+      users[i].roomID = DEFAULT_ROOM;
+   }
+   return users;
+}
+
+
+/* insertUser, get_user and removeUser on a list of n users */
+static void bench_user_list(Node **list, char *variant, long n, long ops) {
+   User *users = make_users(n);
+   long i;
+   unsigned int seed = 1;
+   double start;
+
+   start = now_ns();
+   for (i = 0; i < n; i++) {
+      insertUser(list, &users[i], &bench_lock);
+   }
+   report("insertUser", variant, n, n, now_ns() - start);
+
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      get_user(list, users[rand_r(&seed) % n].username, &bench_lock);
+   }
+   report("get_user", variant, n, ops, now_ns() - start);
+
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      get_user(list, "nosuchuser", &bench_lock);
+   }
+   report("get_user_missing", variant, n, ops, now_ns() - start);
+
+   // Each removal is put back so the list keeps its size
+   if (ops > n) { ops = n; }
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      removeUser(list, &users[i], &bench_lock);
+      insertUser(list, &users[i], &bench_lock);
+   }
+   report("removeUser_insertUser", variant, n, ops, now_ns() - start);
+
+   for (i = 0; i < n; i++) {
+      removeUser(list, &users[i], &bench_lock);
+   }
+   free(users);
+}
+
+
+static void bench_users() {
+   long sizes[] = { 100, 1000, 10000, 100000 };
+   int i;
+
+   if (!wanted("user")) { return; }
+   createUserIndex(&indexed_list);
+   for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+      bench_user_list(&indexed_list, "indexed", sizes[i], BENCH_OPS);
+      // A scan costs n, so the plain list gets fewer operations as it grows
+      if (sizes[i] <= BENCH_PLAIN_MAX) {
+         bench_user_list(&plain_list, "list", sizes[i], BENCH_OPS * 100 / sizes[i] < BENCH_OPS ? BENCH_OPS * 100 / sizes[i] : BENCH_OPS);
+      }
+   }
+}
+
+
+/* sanitizeInput over a chat line and a name, clean and with characters to replace */
+static void bench_sanitize() {
+   char clean[BUFFERSIZE], dirty[BUFFERSIZE], buf[BUFFERSIZE];
+   long i, ops = BENCH_OPS;
+   double start;
+
+   if (!wanted("sanitize")) { return; }
+   memset(clean, 'a', sizeof(clean) - 1);
+   clean[sizeof(clean) - 1] = '\0';
+   strcpy(dirty, clean);
+   for (i = 0; i < (long) sizeof(dirty) - 1; i += 8) { dirty[i] = '\t'; }
+
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      strcpy(buf, clean);
+      sanitizeInput(buf, 0);
+   }
+   report("sanitizeInput", "message_clean", BUFFERSIZE - 1, ops, now_ns() - start);
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      strcpy(buf, dirty);
+      sanitizeInput(buf, 0);
+   }
+   report("sanitizeInput", "message_dirty", BUFFERSIZE - 1, ops, now_ns() - start);
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      strcpy(buf, "some_user-name42");
+      sanitizeInput(buf, 1);
+   }
+   report("sanitizeInput", "name", 16, ops, now_ns() - start);
+}
+
+
+/* Formatting of a room log line from the framed message, as the log writer does it */
+static void bench_log_format() {
+   char *line = (char *)malloc(LOG_LINE);
+   packet pkt;
+   OutMsg *msg;
+   long i, ops = BENCH_OPS;
+   double start;
+
+   if (!wanted("log")) { free(line); return; }
+   memset(&pkt, 0, sizeof(packet));
+   pkt.options = DEFAULT_ROOM;
+   pkt.timestamp = time(NULL);
+   strcpy(pkt.username, "benchuser");
+   strcpy(pkt.realname, "Bench User");
+   memset(pkt.buf, 'x', BUFFERSIZE - 1);
+
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      msg = encode_message(PROTO_FRAMED, &pkt);
+      release_message(msg);
+   }
+   report("encode_message", "framed", BUFFERSIZE - 1, ops, now_ns() - start);
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      msg = encode_message(PROTO_LEGACY, &pkt);
+      release_message(msg);
+   }
+   report("encode_message", "legacy", BUFFERSIZE - 1, ops, now_ns() - start);
+
+   msg = encode_message(PROTO_FRAMED, &pkt);
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      format_log_line(msg, line);
+   }
+   report("format_log_line", "framed", BUFFERSIZE - 1, ops, now_ns() - start);
+   release_message(msg);
+   free(line);
+}
+
+
+/* The server's password hashing and comparison, as run by login() */
+static void bench_passwords() {
+   unsigned char stored[SHA256_DIGEST], hash[SHA256_DIGEST];
+   char *password = "correcthorse";
+   long i, ops = BENCH_HASHES;
+   double start;
+
+   if (!wanted("password")) { return; }
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      hashPassword(password, hash);
+      sink = hash[0];
+   }
+   report("password_sha256", "login", strlen(password), ops, now_ns() - start);
+
+   ops = BENCH_OPS;
+   memcpy(stored, hash, sizeof(stored));
+   start = now_ns();
+   for (i = 0; i < ops; i++) {
+      // The volatile sink keeps the compare from being dropped
+      sink = comparePasswords(stored, hash, 32);
+   }
+   report("comparePasswords", "match", 32, ops, now_ns() - start);
+}
+
+
+/* send_message fanning a chat line out to a room of members on socket pairs */
+static void bench_fanout_room(int members, int proto, char *variant) {
+   char name[ROOMNAME_LENGTH];
+   char scratch[READ_CHUNK];
+   int (*pairs)[2] = calloc(members, sizeof(*pairs));
+   User *users = make_users(members + 1);
+   Connection *conn;
+   Room *room;
+   Node *node;
+   packet pkt;
+   long i, ops = BENCH_DELIVERIES / members < BENCH_ROUNDS ? BENCH_DELIVERIES / members : BENCH_ROUNDS;
+   double start, elapsed = 0;
+   int m, made = 0;
+
+   snprintf(name, sizeof(name), "bench%s%d", variant, members);
+   createRoom(&room_list, numRooms, name, &rooms_lock);
+   room = Rget_roomFID(&room_list, numRooms++, &rooms_lock);
+   for (m = 0; m < members; m++) {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[m]) == -1) { break; }
+      fcntl(pairs[m][1], F_SETFL, O_NONBLOCK);
+      if ((conn = open_connection(pairs[m][0])) == NULL) { break; }
+      conn->proto = proto;
+      users[m].sock = pairs[m][0];
+      node = (Node *)malloc(sizeof(Node));
+      node->data = &users[m];
+      insertNode(&room->user_list, node, &room->user_list_lock);
+      made++;
+   }
+
+   memset(&pkt, 0, sizeof(packet));
+   strcpy(pkt.username, "benchsender");
+   strcpy(pkt.realname, "benchsender");
+   snprintf(pkt.buf, BUFFERSIZE, "a typical chat line of a few words");
+   for (i = 0; i < ops; i++) {
+      pkt.options = room->ID;
+      pkt.timestamp = time(NULL);
+      start = now_ns();
+      send_message(&pkt, -1);
+      elapsed += now_ns() - start;
+      // Members read what they were sent outside the timed part
+      for (m = 0; m < made; m++) {
+         while (recv(pairs[m][1], scratch, sizeof(scratch), MSG_DONTWAIT) > 0) { }
+      }
+   }
+   report("send_message", variant, made, ops, elapsed);
+
+   for (m = 0; m < made; m++) {
+      close_connection(get_connection(pairs[m][0]));
+      close(pairs[m][1]);
+   }
+   free(pairs);
+}
+
+
+static void bench_fanout() {
+   int sizes[] = { 1, 10, 100, 1000 };
+   int i;
+
+   if (!wanted("send_message")) { return; }
+   for (i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+      bench_fanout_room(sizes[i], PROTO_LEGACY, "legacy");
+      bench_fanout_room(sizes[i], PROTO_FRAMED, "framed");
+   }
+}
+
+
+int main(int argc, char **argv) {
+   char dir[] = "/tmp/tbdchat_bench_XXXXXX";
+   char cmd[sizeof(dir) + 16];
+
+   if (argc > 1) { only = argv[1]; }
+   // Results keep the real stdout, the modules' printing goes nowhere
+   results = fdopen(dup(STDOUT_FILENO), "w");
+   if (results == NULL || freopen("/dev/null", "w", stdout) == NULL || mkdtemp(dir) == NULL || chdir(dir) == -1) {
+      fprintf(stderr, "Could not set up the benchmark.\n");
+      return 1;
+   }
+   signal(SIGPIPE, SIG_IGN);
+   init_connections();
+   createRoomIndex(&room_list);
+   createRoom(&room_list, numRooms++, DEFAULT_ROOM_NAME, &rooms_lock);
+   start_room_log();
+
+   bench_users();
+   bench_sanitize();
+   bench_log_format();
+   bench_passwords();
+   bench_fanout();
+
+   stop_room_log();
+   snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+   if (chdir("/") == -1 || system(cmd) != 0) {
+      fprintf(stderr, "Could not remove %s.\n", dir);
+   }
+   return 0;
+}
@@ -33,10 +33,13 @@ pthread_mutex_t nameMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t debugModeMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t configFileMutex = PTHREAD_MUTEX_INITIALIZER;
 volatile int currentRoom;
+volatile uint32_t lastSeq;   // newest message seen in currentRoom, sent back on resume
 volatile int debugMode;
+volatile int protocol = PROTO_LEGACY;
 char realname[64];
 char username[64];
 char logfile[64];
+char session_token[SESSION_TOKEN + 1];   // lets a reconnect skip /login
 pthread_t chat_rx_thread;
 char *config_file;
 WINDOW *mainWin, *inputWin, *chatWin, *chatWinBox, *inputWinBox, *infoLine, *infoLineBottom;
@@ -91,7 +94,14 @@ int main(int argc, char **argv) {
       if(bufSize > 0 && tx_pkt.buf[bufSize] != EOF) {
          // Check if the input should be read as a command, if so process the command
          if(strncmp("/", (void *)tx_pkt.buf, 1) == 0) {
-             send_flag = userCommand(tx_pkt_ptr);
+            // Only room messages may use the longer framed buffer
+            if (bufSize >= BUFFERSIZE) {
+               wprintFormatError(chatWin, time(NULL), "Command too long");
+               send_flag = 0;
+            }
+            else {
+               send_flag = userCommand(tx_pkt_ptr);
+            }
          }
          else if(send_flag) {
             pthread_mutex_lock(&nameMutex);
@@ -120,7 +130,7 @@ int main(int argc, char **argv) {
             pthread_mutex_unlock(&roomMutex);
             // If packet options has been altered appropriately, send it
             if (tx_pkt.options > 0) {
-               send(serverfd, (void *)&tx_pkt, sizeof(packet), MSG_NOSIGNAL);
+               send_packet(serverfd, &tx_pkt);
             }
          }
          // If send flag is true but serverfd is still 0, print error
@@ -206,6 +216,7 @@ int auto_connect() {
 int userInput(packet *tx_pkt) {
    int i = 0;
    int ch;
+   int limit = (protocol == PROTO_FRAMED) ? MESSAGE_LENGTH : BUFFERSIZE;
    wmove(inputWin, 0, 0);
    wrefresh(inputWin);
    // Read 1 char at a time
@@ -226,7 +237,7 @@ int userInput(packet *tx_pkt) {
       }
       // Otherwise put in buffer
       else if (ch != ERR) {
-         if (i < BUFFERSIZE - 1) {
+         if (i < limit - 1) {
             strcat(tx_pkt->buf, (char *)&ch);
             i++;
             wprintw(inputWin, (char *)&ch);
@@ -253,14 +264,28 @@ int userInput(packet *tx_pkt) {
 void *chatRX(void *ptr) {
    packet rx_pkt;
    packet *rx_pkt_ptr = &rx_pkt;
-   int received, i;
+   int received, used, i;
    int *serverfd = (int *)ptr;
    struct tm *timestamp;
+   char rx_buf[RX_BUFFER];
+   size_t rx_len = 0;
    while (1) {
       // Wait for message to arrive..
-      received = recv(*serverfd, (void *)&rx_pkt, sizeof(packet), 0);
+      received = recv(*serverfd, rx_buf + rx_len, sizeof(rx_buf) - rx_len, 0);
+      if (received == -1 && errno == EINTR) { continue; }
+      // End of file or a dead socket, stop reading instead of spinning on it
+      if (received <= 0) {
+         wprintFormatNotice(chatWin, time(NULL), "Communication with server has terminated.");
+         if (received == 0 || errno != EBADF) { close(*serverfd); }
+         *serverfd = 0;
+         break;
+      }
+      rx_len += received;
 
-      if (received) {
+      // Handle every whole packet in the buffer, keep a trailing partial one
+      while ((used = decode_packet(protocol, rx_buf, rx_len, rx_pkt_ptr)) > 0) {
+         rx_len -= used;
+         memmove(rx_buf, rx_buf + used, rx_len);
          // If debug mode is enabled, dump packet contents
          pthread_mutex_lock(&debugModeMutex);
          if (debugMode) {
@@ -269,6 +294,7 @@ void *chatRX(void *ptr) {
          pthread_mutex_unlock(&debugModeMutex);
          // If the received packet is a message packet, print accordingly
          if (rx_pkt.options >= 1000) {
+            if (rx_pkt.options == currentRoom && rx_pkt.seq > lastSeq) { lastSeq = rx_pkt.seq; }
             timestamp = localtime(&(rx_pkt.timestamp));
             if (strcmp(rx_pkt.realname, SERVER_NAME) == 0) { i = 3; }
             else { i = hash(rx_pkt.username, 12); }
@@ -276,13 +302,8 @@ void *chatRX(void *ptr) {
             beep();
          }
          // If the received packet is a nonmessage option, handle option response
-         else if (rx_pkt.options > 0 && rx_pkt.options < 1000) {
-            serverResponse(rx_pkt_ptr);
-         }
-         // If the received packet contains 0 as the option, we likely received and empty packet, end transmission
          else {
-            wprintFormatNotice(chatWin, time(NULL), "Communication with server has terminated.");
-            break;
+            serverResponse(rx_pkt_ptr);
          }
          log_message(&rx_pkt, logfd);
          // Wipe packet space
@@ -291,7 +312,16 @@ void *chatRX(void *ptr) {
          wrefresh(inputWin);
          memset(&rx_pkt, 0, sizeof(packet));
       }
+      if (used == -1) {
+         wprintFormatError(chatWin, time(NULL), "Malformed packet received from server");
+         close(*serverfd);
+         *serverfd = 0;
+         break;
+      }
    }
+   wrefresh(chatWin);
+   wcursyncup(inputWin);
+   wrefresh(inputWin);
    return NULL;
 }
 
@@ -331,6 +361,9 @@ void serverResponse(packet *rx_pkt) {
    else if (rx_pkt->options == GETROOMS) {
       roomListResponse(rx_pkt);
    }
+   else if (rx_pkt->options == GETHISTORY || rx_pkt->options == SEARCH) {
+      wprintFormatNotice(chatWin, rx_pkt->timestamp, rx_pkt->buf);
+   }
    else if (rx_pkt->options == MOTD) {
       wprintFormatmotd(chatWin, rx_pkt->timestamp, rx_pkt->buf);
    }
@@ -351,9 +384,11 @@ void loggedIn(packet *rx_pkt) {
    pthread_mutex_lock(&nameMutex);
    strcpy(username, rx_pkt->username);
    strcpy(realname, rx_pkt->realname);
+   strncpy(session_token, rx_pkt->buf, SESSION_TOKEN);
    pthread_mutex_unlock(&nameMutex);
    pthread_mutex_lock(&roomMutex);
    currentRoom = DEFAULT_ROOM;
+   lastSeq = 0;
    strcpy(logfile, getenv("HOME"));
    strcat(logfile, "/");
    strcat(logfile, username);
@@ -442,6 +477,7 @@ void newRoom(packet *rx_pkt) {
       pthread_mutex_lock(&roomMutex);
       if (roomNumber != currentRoom) {
          currentRoom = roomNumber;
+         lastSeq = 0;
          close(logfd);
          strcpy(logfile, getenv("HOME"));
          strcat(logfile, "/");
@@ -496,6 +532,7 @@ int get_server_connection(char *hostname, char *port) {
          wprintFormatError(chatWin, time(NULL), "socket connect");
          return -1;
       }
+      setKeepalive(serverfd);
       break;
    }
    print_ip(servinfo);
@@ -504,6 +541,20 @@ int get_server_connection(char *hostname, char *port) {
 }
 
 
+/* Have the kernel probe an idle server connection so a dead link is noticed */
+void setKeepalive(int fd) {
+   int yes = 1;
+   int idle = KEEPALIVE_IDLE;
+   int interval = KEEPALIVE_INTERVAL;
+   int count = KEEPALIVE_COUNT;
+
+   setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+
 /* Print new connection information */
 void print_ip( struct addrinfo *ai) {
    struct addrinfo *p;
@@ -554,7 +605,7 @@ void sigintHandler(int sig_num) {
       pthread_mutex_unlock(&nameMutex);
       tx_pkt.timestamp = time(NULL);
       tx_pkt.options = EXIT;
-      send(serverfd, (void *)&tx_pkt, sizeof(packet), 0);
+      send_packet(serverfd, &tx_pkt);
       close(logfd);
       close(serverfd);
       if (chat_rx_thread) {
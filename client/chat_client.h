@@ -22,6 +22,8 @@
 /* System Header Files */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -29,6 +31,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <signal.h>
 #include <pthread.h>
@@ -42,7 +45,10 @@
 /* Preprocessor Macros */
 
 // Client buffer size
-#define BUFFERSIZE 128
+#define BUFFERSIZE 128          // text carried by a legacy packet
+#define MESSAGE_LENGTH 1024     // text carried by a framed room message
+#define USERNAME_LENGTH 64
+#define REALNAME_LENGTH 64
 #define DEFAULT_ROOM 1000
 #define SERVER_NAME "SERVER"
 #define VERSION "0.5.0"
@@ -63,6 +69,10 @@
 #define LEAVE 11
 #define GETMOTD 12
 #define GETROOMS 13
+#define PROTOCOL 14
+#define GETHISTORY 15
+#define SEARCH 16
+#define RESUME 17
 
 // Server responses
 #define LOGSUC 100
@@ -74,6 +84,21 @@
 #define INVITESUC 106
 #define SERV_ERR 107
 
+// Wire protocols
+#define PROTO_LEGACY 1          // fixed size legacy_packet
+#define PROTO_FRAMED 2          // length prefixed frames, see protocol.c
+#define FRAME_HEADER 20
+#define FRAME_MESSAGE 1000      // frame type of a room message
+#define FRAME_SERVER 0x1        // frame flag, sender names omitted
+#define MAX_FRAME (FRAME_HEADER + 2 + USERNAME_LENGTH + REALNAME_LENGTH + MESSAGE_LENGTH)
+#define RX_BUFFER (4 * MAX_FRAME)
+#define HISTORY_MINUTES 60      // default span of /history
+#define SESSION_TOKEN 32        // characters of the resume token sent with LOGSUC
+#define NEGOTIATE_TIMEOUT 2     // seconds to wait for a PROTOCOL reply
+#define KEEPALIVE_IDLE 60       // s of silence before probing the server
+#define KEEPALIVE_INTERVAL 10   // s between probes
+#define KEEPALIVE_COUNT 3       // unanswered probes before the socket errors
+
 // Defined color constants
 #define NORMAL "\x1B[0m"
 #define BLACK "\x1B[30;1m"
@@ -91,13 +116,24 @@
 // Packet
 struct Packet {
    time_t timestamp;
-   char buf[BUFFERSIZE];
+   char buf[MESSAGE_LENGTH];
    char username[64];
    char realname[64];
    int options;
+   uint32_t seq;           // room message sequence number, framed protocol only
 };
 typedef struct Packet packet;
 
+// Packet as sent on the wire when framing has not been negotiated
+struct LegacyPacket {
+   time_t timestamp;
+   char buf[BUFFERSIZE];
+   char username[64];
+   char realname[64];
+   int options;
+};
+typedef struct LegacyPacket legacy_packet;
+
 
 /* Function Prototypes */
 
@@ -105,6 +141,7 @@ typedef struct Packet packet;
 void sigintHandler(int sig_num);
 void print_ip( struct addrinfo *ai);
 int get_server_connection(char *hostname, char *port);
+void setKeepalive(int fd);
 void *chatRX(void *ptr);
 int userInput(packet *tx_pkt);
 void buildDefaultConfig();
@@ -121,6 +158,7 @@ int hash(char *str, int mod);
 int userCommand(packet *tx_pkt);
 int newServerConnection(char *buf);
 int reconnect(char *buf);
+int resumeSession();
 int serverLogin(packet *tx_pkt);
 int serverRegistration(packet *tx_pkt);
 int setPassword(packet *tx_pkt);
@@ -129,10 +167,18 @@ void debugPacket(packet *rx_pkt);
 int toggleAutoConnect();
 int validJoin(packet *tx_pkt);
 int validInvite(packet *tx_pkt);
+int validHistory(packet *tx_pkt);
+int validSearch(packet *tx_pkt);
 void showHelp(char *buf);
 void log_message(packet *tx_pkt, int fd);
 void show_log(packet *tx_pkt);
 
+// protocol.c
+size_t encode_packet(int proto, packet *pkt, char *out);
+int decode_packet(int proto, char *data, size_t len, packet *pkt);
+int send_packet(int fd, packet *pkt);
+int negotiate_protocol(int fd);
+
 // visual.c
 void initializeCurses();
 void drawChatWin();
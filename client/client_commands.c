@@ -25,9 +25,11 @@
 /* Declared.  Defined and allocated in chat_client.c */
 extern int serverfd;
 extern volatile int currentRoom;
+extern volatile uint32_t lastSeq;
 extern volatile int debugMode;
 extern char username[64];
 extern char realname[64];
+extern char session_token[SESSION_TOKEN + 1];
 extern char *config_file;
 extern WINDOW *mainWin, *chatWin, *inputWin;
 extern pthread_t chat_rx_thread;
@@ -45,6 +47,10 @@ int userCommand(packet *tx_pkt) {
        (strncmp((void *)tx_pkt->buf, "/quit", strlen("/quit")) == 0)) {
        sprintf(tx_pkt->buf, "%s %d", tx_pkt->buf, currentRoom);
        tx_pkt->options = EXIT;
+       // A goodbye ends the session on the server, so forget it here too
+       pthread_mutex_lock(&nameMutex);
+       memset(session_token, 0, sizeof(session_token));
+       pthread_mutex_unlock(&nameMutex);
        return 1;;
    }
    // Handle clear command
@@ -161,6 +167,14 @@ int userCommand(packet *tx_pkt) {
        tx_pkt->options = GETROOMS;
        return 1;
    }
+   // Handle history command
+   else if (strncmp((void *)tx_pkt->buf, "/history", strlen("/history")) == 0) {
+       return validHistory(tx_pkt);
+   }
+   // Handle search command
+   else if (strncmp((void *)tx_pkt->buf, "/search", strlen("/search")) == 0) {
+       return validSearch(tx_pkt);
+   }
    /*
    // Handle showlog command
    else if(strncmp((void *)tx_pkt->buf, "/showlog", strlen("/showlog")) == 0) {
@@ -232,6 +246,53 @@ int validJoin(packet *tx_pkt) {
 }
 
 
+/* Turns /history [minutes] into the time range asked of the server for currentroom */
+int validHistory(packet *tx_pkt) {
+   int minutes = HISTORY_MINUTES;
+   time_t now = time(NULL);
+   char *arg = tx_pkt->buf + strlen("/history");
+
+   while (*arg == ' ' || *arg == '\t') { arg++; }
+   if (*arg != '\0' && (minutes = atoi(arg)) <= 0) {
+      wprintFormatError(chatWin, time(NULL), "Usage: /history [minutes]");
+      return 0;
+   }
+   tx_pkt->options = GETHISTORY;
+   memset(&tx_pkt->buf, 0, sizeof(tx_pkt->buf));
+   pthread_mutex_lock(&roomMutex);
+   sprintf(tx_pkt->buf, "%ld %ld %d", (long) (now - minutes * 60L), (long) now, currentRoom);
+   pthread_mutex_unlock(&roomMutex);
+   return 1;
+}
+
+
+/* Uses everything after /search as the words to find in currentroom */
+int validSearch(packet *tx_pkt) {
+   char words[BUFFERSIZE];
+   char *arg = tx_pkt->buf + strlen("/search");
+   int len;
+
+   while (*arg == ' ' || *arg == '\t') { arg++; }
+   if (*arg == '\0') {
+      wprintFormatError(chatWin, time(NULL), "Usage: /search words");
+      return 0;
+   }
+   strncpy(words, arg, sizeof(words) - 1);
+   words[sizeof(words) - 1] = '\0';
+   tx_pkt->options = SEARCH;
+   memset(&tx_pkt->buf, 0, sizeof(tx_pkt->buf));
+   pthread_mutex_lock(&roomMutex);
+   len = snprintf(tx_pkt->buf, BUFFERSIZE, "%d %s", currentRoom, words);
+   pthread_mutex_unlock(&roomMutex);
+   // The room number goes in front, a search cut short would look for something else
+   if (len >= BUFFERSIZE) {
+      wprintFormatError(chatWin, time(NULL), "Search too long");
+      return 0;
+   }
+   return 1;
+}
+
+
 /* Connect to a new server */
 int newServerConnection(char *buf) {
    int i = 0;
@@ -251,6 +312,9 @@ int newServerConnection(char *buf) {
          wprintFormatError(chatWin, time(NULL), "Could not connect to server");
          return 0;
       }
+      if (negotiate_protocol(serverfd) == PROTO_FRAMED) {
+         wprintFormatNotice(chatWin, time(NULL), "Using framed protocol");
+      }
       if(pthread_create(&chat_rx_thread, NULL, chatRX, (void *)&serverfd)) {
          wprintFormatError(chatWin, time(NULL), "chatRX thread not created");
          return 0;
@@ -300,7 +364,9 @@ int reconnect(char *buf) {
                   strcat(buf, line + strlen("last connection: "));
                   fclose(configfp);
                   pthread_mutex_unlock(&configFileMutex);
-                  return newServerConnection(buf);
+                  if (!newServerConnection(buf)) { return 0; }
+                  resumeSession();
+                  return 1;
                }
                else {
                   fclose(configfp);
@@ -320,6 +386,24 @@ int reconnect(char *buf) {
 }
 
 
+/* Pick up the session of the last login on a new connection, if there is one */
+int resumeSession() {
+   packet tx_pkt;
+
+   memset(&tx_pkt, 0, sizeof(packet));
+   pthread_mutex_lock(&nameMutex);
+   strcpy(tx_pkt.buf, session_token);
+   pthread_mutex_unlock(&nameMutex);
+   if (tx_pkt.buf[0] == '\0') { return 0; }
+   // Only what came after the last message shown is sent again
+   sprintf(tx_pkt.buf + strlen(tx_pkt.buf), " %u", lastSeq);
+   tx_pkt.options = RESUME;
+   tx_pkt.timestamp = time(NULL);
+   wprintFormatNotice(chatWin, time(NULL), "Resuming session . . .");
+   return send_packet(serverfd, &tx_pkt) > 0;
+}
+
+
 /* Toggle autoconnect state in config file */
 int toggleAutoConnect() {
    FILE *configfp;
@@ -1422,6 +1506,106 @@ void showHelp(char *buf) {
       }
    }
 
+   // history
+   if (strcmp(cmd, "history")  == 0 || strcmp(cmd, "all") == 0 || strcmp(cmd, "none") == 0) {
+      wprintFormatTime(chatWin, time(NULL));
+      wattron(chatWin, COLOR_PAIR(command));
+      wprintw(chatWin, "   /history     ");
+      wattroff(chatWin, COLOR_PAIR(command));
+      wattron(chatWin, COLOR_PAIR(bar));
+      wprintw(chatWin, " ");
+      waddch(chatWin, ACS_VLINE);
+      wprintw(chatWin, " \n");
+      if (strcmp(cmd, "history")  == 0 || strcmp(cmd, "all") == 0) {
+         wattroff(chatWin, COLOR_PAIR(bar));
+         wprintFormatTime(chatWin, time(NULL));
+         wprintw(chatWin, "        ");
+         waddch(chatWin, ACS_LLCORNER);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_TTEE);
+         wattron(chatWin, COLOR_PAIR(bar));
+         wprintw(chatWin, " ");
+         waddch(chatWin, ACS_VLINE);
+         wprintw(chatWin, " ");
+         wattroff(chatWin, COLOR_PAIR(bar));
+         wattron(chatWin, COLOR_PAIR(title));
+         wprintw(chatWin, "Usage: ");
+         wattroff(chatWin, COLOR_PAIR(title));
+         wattron(chatWin, COLOR_PAIR(1));
+         wprintw(chatWin, "/history [minutes]\n");
+         wattroff(chatWin, COLOR_PAIR(1));
+         wprintFormatTime(chatWin, time(NULL));
+         wprintw(chatWin, "               ");
+         waddch(chatWin, ACS_LLCORNER);
+         wattron(chatWin, COLOR_PAIR(bar));
+         wprintw(chatWin, " ");
+         waddch(chatWin, ACS_VLINE);
+         wprintw(chatWin, " ");
+         wattroff(chatWin, COLOR_PAIR(bar));
+         wattron(chatWin, COLOR_PAIR(title));
+         wprintw(chatWin, "Desc: ");
+         wattroff(chatWin, COLOR_PAIR(title));
+         wattron(chatWin, COLOR_PAIR(1));
+         wprintw(chatWin, "Show what was said in this room lately\n");
+         wattroff(chatWin, COLOR_PAIR(1));
+      }
+   }
+
+   // search
+   if (strcmp(cmd, "search")  == 0 || strcmp(cmd, "all") == 0 || strcmp(cmd, "none") == 0) {
+      wprintFormatTime(chatWin, time(NULL));
+      wattron(chatWin, COLOR_PAIR(command));
+      wprintw(chatWin, "   /search      ");
+      wattroff(chatWin, COLOR_PAIR(command));
+      wattron(chatWin, COLOR_PAIR(bar));
+      wprintw(chatWin, " ");
+      waddch(chatWin, ACS_VLINE);
+      wprintw(chatWin, " \n");
+      if (strcmp(cmd, "search")  == 0 || strcmp(cmd, "all") == 0) {
+         wattroff(chatWin, COLOR_PAIR(bar));
+         wprintFormatTime(chatWin, time(NULL));
+         wprintw(chatWin, "        ");
+         waddch(chatWin, ACS_LLCORNER);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_HLINE);
+         waddch(chatWin, ACS_TTEE);
+         wattron(chatWin, COLOR_PAIR(bar));
+         wprintw(chatWin, " ");
+         waddch(chatWin, ACS_VLINE);
+         wprintw(chatWin, " ");
+         wattroff(chatWin, COLOR_PAIR(bar));
+         wattron(chatWin, COLOR_PAIR(title));
+         wprintw(chatWin, "Usage: ");
+         wattroff(chatWin, COLOR_PAIR(title));
+         wattron(chatWin, COLOR_PAIR(1));
+         wprintw(chatWin, "/search words\n");
+         wattroff(chatWin, COLOR_PAIR(1));
+         wprintFormatTime(chatWin, time(NULL));
+         wprintw(chatWin, "               ");
+         waddch(chatWin, ACS_LLCORNER);
+         wattron(chatWin, COLOR_PAIR(bar));
+         wprintw(chatWin, " ");
+         waddch(chatWin, ACS_VLINE);
+         wprintw(chatWin, " ");
+         wattroff(chatWin, COLOR_PAIR(bar));
+         wattron(chatWin, COLOR_PAIR(title));
+         wprintw(chatWin, "Desc: ");
+         wattroff(chatWin, COLOR_PAIR(title));
+         wattron(chatWin, COLOR_PAIR(1));
+         wprintw(chatWin, "Find messages in this room holding every word\n");
+         wattroff(chatWin, COLOR_PAIR(1));
+      }
+   }
+
    wprintSeperator(chatWin, bar);
 }
 
@@ -1430,7 +1614,7 @@ void showHelp(char *buf) {
  */
 void log_message(packet *tx_pkt, int fd) {
    if(fd) {
-      char *temp = (char*)malloc(256 * sizeof(char));
+      char *temp = (char*)malloc((64 + sizeof(tx_pkt->realname) + sizeof(tx_pkt->buf)) * sizeof(char));
       strcpy(temp, asctime(localtime(&(tx_pkt->timestamp))));
       temp[strlen(temp) - 1] = ' ';
       strncat(temp, "| [", 3);
@@ -0,0 +1,420 @@
+/*
+//   Program:             TBD Chat Client
+//   File Name:           load_client.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_client.h"
+#include <sys/epoll.h>
+
+/*
+ *Headless load generator.  Scripted users register or log in, join one of
+ *a number of rooms and chat at a fixed rate, now and then asking for the
+ *room's users, everyone online or the room list.  Each chat line carries
+ *the time it was sent, so every member that receives it adds a send to
+ *receive latency sample.  Users are spread over worker threads, each
+ *reading its users' sockets through one epoll set.
+ */
+#define LOAD_USERS 100          // default scripted users
+#define LOAD_ROOMS 10           // default rooms they are spread over
+#define LOAD_RATE 1.0           // default messages per second of each user
+#define LOAD_SECONDS 10         // default length of the chat phase
+#define LOAD_THREADS 4          // default worker threads
+#define LOAD_COMMANDS 5         // default percent of actions that are commands
+#define LOAD_PASSWORD "loadpass"
+#define LOAD_TAG "lg "          // chat lines start with this and the send time
+#define LOAD_SETTLE 2           // s the chat phase waits for slow logins and joins
+#define LOAD_EVENTS 64          // epoll events handled per wakeup
+#define LAT_SUB 16              // histogram buckets per power of two
+#define LAT_BUCKETS (LAT_SUB * 40)
+
+// States of a scripted user
+#define USER_LOGIN 0            // register or login sent
+#define USER_JOIN 1             // join sent
+#define USER_CHAT 2
+#define USER_DEAD 3
+
+struct load_user {
+   int id;
+   int fd;
+   int state;
+   int tried_login;        // register failed and a login was sent
+   unsigned int seed;      // picks between chat lines and commands
+   int roomID;
+   char name[USERNAME_LENGTH];
+   char *rx_buf;
+   size_t rx_len;
+   uint64_t next_send;     // ns, CLOCK_MONOTONIC
+};
+typedef struct load_user LoadUser;
+
+struct load_worker {
+   pthread_t thread;
+   int epfd;
+   LoadUser *users;
+   int num_users;
+   uint64_t ready;         // users that reached the chat phase
+   uint64_t sent;
+   uint64_t received;
+   uint64_t commands;
+   uint64_t errors;
+   uint64_t latency[LAT_BUCKETS];   // send to receive times in us
+};
+typedef struct load_worker LoadWorker;
+
+volatile int protocol = PROTO_LEGACY;
+static char *host, *port, *prefix = "load";
+static int num_rooms = LOAD_ROOMS;
+static int command_percent = LOAD_COMMANDS;
+static int framed = 0;
+static double rate = LOAD_RATE;
+static uint64_t start_ns, end_ns;
+
+
+static uint64_t now_ns() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Histogram bucket of a latency, exact below LAT_SUB us and within 1/LAT_SUB above */
+static int lat_bucket(uint64_t us) {
+   int msb;
+
+   if (us < LAT_SUB) { return (int) us; }
+   msb = 63 - __builtin_clzll(us);
+   if (msb > LAT_BUCKETS / LAT_SUB + 2) { return LAT_BUCKETS - 1; }
+   return (msb - 3) * LAT_SUB + (int) ((us >> (msb - 4)) & (LAT_SUB - 1));
+}
+
+
+/* Smallest latency that falls in a bucket */
+static uint64_t lat_value(int bucket) {
+   int msb;
+
+   if (bucket < LAT_SUB) { return bucket; }
+   msb = bucket / LAT_SUB + 3;
+   return ((uint64_t) (LAT_SUB + bucket % LAT_SUB)) << (msb - 4);
+}
+
+
+/* Latency below which a fraction q of the samples fall */
+static uint64_t lat_percentile(uint64_t *hist, uint64_t total, double q) {
+   uint64_t seen = 0;
+   int i;
+
+   if (total == 0) { return 0; }
+   for (i = 0; i < LAT_BUCKETS; i++) {
+      seen += hist[i];
+      if (seen >= (uint64_t) (q * total) && seen > 0) { return lat_value(i); }
+   }
+   return lat_value(LAT_BUCKETS - 1);
+}
+
+
+/* Plain blocking connection to the server, the chat client's one writes to curses */
+static int connect_server() {
+   struct addrinfo hints, *servinfo, *p;
+   int fd = -1;
+
+   memset(&hints, 0, sizeof hints);
+   hints.ai_family = PF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   if (getaddrinfo(host, port, &hints, &servinfo) != 0) { return -1; }
+   for (p = servinfo; p != NULL; p = p->ai_next) {
+      if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) { continue; }
+      if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) { break; }
+      close(fd);
+      fd = -1;
+   }
+   freeaddrinfo(servinfo);
+   return fd;
+}
+
+
+/* Send a request on behalf of a user */
+static int user_send(LoadUser *user, int options, char *buf) {
+   packet pkt;
+
+   memset(&pkt, 0, sizeof(packet));
+   pkt.options = options;
+   pkt.timestamp = time(NULL);
+   strcpy(pkt.username, user->name);
+   strcpy(pkt.realname, user->name);
+   strncpy(pkt.buf, buf, BUFFERSIZE - 1);
+   if (send_packet(user->fd, &pkt) == -1) {
+      user->state = USER_DEAD;
+      return -1;
+   }
+   return 0;
+}
+
+
+/* Drive a user's script on a reply from the server */
+static void user_reply(LoadWorker *worker, LoadUser *user, packet *pkt) {
+   char buf[BUFFERSIZE];
+   char *text;
+   uint64_t sent;
+
+   if (pkt->options >= DEFAULT_ROOM) {
+      // Only other users' timed lines in the user's own room are samples
+      if (pkt->options != user->roomID || strncmp(pkt->buf, LOAD_TAG, strlen(LOAD_TAG)) != 0) { return; }
+      sent = strtoull(pkt->buf + strlen(LOAD_TAG), &text, 10);
+      // Lines replayed from an earlier run are not samples either
+      if (text == pkt->buf + strlen(LOAD_TAG) || sent < start_ns) { return; }
+      worker->received++;
+      worker->latency[lat_bucket((now_ns() - sent) / 1000)]++;
+   }
+   else if (user->state == USER_LOGIN && pkt->options == LOGSUC) {
+      snprintf(buf, sizeof(buf), "%sroom%d %d", prefix, user->id % num_rooms, DEFAULT_ROOM);
+      user_send(user, JOIN, buf);
+      user->state = USER_JOIN;
+   }
+   else if (user->state == USER_LOGIN && pkt->options == SERV_ERR && !user->tried_login) {
+      // Registered by an earlier run
+      snprintf(buf, sizeof(buf), "/login %s %s", user->name, LOAD_PASSWORD);
+      user_send(user, LOGIN, buf);
+      user->tried_login = 1;
+   }
+   else if (user->state == USER_JOIN && pkt->options == JOINSUC) {
+      if (sscanf(pkt->buf, "%*s %d", &user->roomID) == 1) {
+         user->state = USER_CHAT;
+         worker->ready++;
+      }
+   }
+   else if (pkt->options == SERV_ERR && user->state != USER_CHAT) {
+      printf("%s --- Error:%s %s: %s\n", RED, NORMAL, user->name, pkt->buf);
+      worker->errors++;
+      user->state = USER_DEAD;
+   }
+}
+
+
+/* Read whatever a user's socket has and handle every whole packet */
+static void user_receive(LoadWorker *worker, LoadUser *user) {
+   packet pkt;
+   ssize_t n;
+   size_t off = 0;
+   int used;
+
+   n = recv(user->fd, user->rx_buf + user->rx_len, RX_BUFFER - user->rx_len, MSG_DONTWAIT);
+   if (n == -1 && (errno == EAGAIN || errno == EINTR)) { return; }
+   if (n <= 0) {
+      if (user->state != USER_DEAD) { worker->errors++; }
+      user->state = USER_DEAD;
+      epoll_ctl(worker->epfd, EPOLL_CTL_DEL, user->fd, NULL);
+      return;
+   }
+   user->rx_len += n;
+   while ((used = decode_packet(protocol, user->rx_buf + off, user->rx_len - off, &pkt)) > 0) {
+      off += used;
+      user_reply(worker, user, &pkt);
+   }
+   user->rx_len -= off;
+   memmove(user->rx_buf, user->rx_buf + off, user->rx_len);
+}
+
+
+/* Send a user's next chat line or, now and then, a command */
+static void user_act(LoadWorker *worker, LoadUser *user, uint64_t now) {
+   char buf[BUFFERSIZE];
+   int pick = rand_r(&user->seed) % 100;
+
+   if (pick < command_percent) {
+      if (pick % 3 == 0) { snprintf(buf, sizeof(buf), "/who %d", user->roomID); user_send(user, GETUSERS, buf); }
+      else if (pick % 3 == 1) { user_send(user, GETALLUSERS, "/who all"); }
+      else { user_send(user, GETROOMS, "/list"); }
+      worker->commands++;
+   }
+   else {
+      snprintf(buf, sizeof(buf), LOAD_TAG "%llu from %s", (unsigned long long) now, user->name);
+      if (user_send(user, user->roomID, buf) == 0) { worker->sent++; }
+   }
+}
+
+
+/* Worker thread, logs its users in and runs them until the end of the test */
+static void *worker_run(void *ptr) {
+   LoadWorker *worker = (LoadWorker *)ptr;
+   struct epoll_event events[LOAD_EVENTS], ev;
+   uint64_t interval = (uint64_t) (1e9 / rate);
+   uint64_t now, next;
+   LoadUser *user;
+   char buf[BUFFERSIZE];
+   int i, n, timeout;
+
+   for (i = 0; i < worker->num_users; i++) {
+      user = &worker->users[i];
+      if ((user->fd = connect_server()) == -1 || (framed && negotiate_protocol(user->fd) != PROTO_FRAMED)) {
+         printf("%s --- Error:%s %s could not connect.\n", RED, NORMAL, user->name);
+         worker->errors++;
+         user->state = USER_DEAD;
+         continue;
+      }
+      user->rx_buf = (char *)malloc(RX_BUFFER);
+      ev.events = EPOLLIN;
+      ev.data.ptr = user;
+      epoll_ctl(worker->epfd, EPOLL_CTL_ADD, user->fd, &ev);
+      snprintf(buf, sizeof(buf), "/register %s %s %s", user->name, LOAD_PASSWORD, LOAD_PASSWORD);
+      user_send(user, REGISTER, buf);
+   }
+
+   while ((now = now_ns()) < end_ns) {
+      // Sleep until the earliest send that is due, reading replies meanwhile
+      next = end_ns;
+      for (i = 0; i < worker->num_users; i++) {
+         user = &worker->users[i];
+         if (user->state != USER_CHAT || now < start_ns) { continue; }
+         if (user->next_send <= now) {
+            user_act(worker, user, now);
+            user->next_send += interval;
+            if (user->next_send < now) { user->next_send = now + interval; }
+         }
+         if (user->next_send < next) { next = user->next_send; }
+      }
+      if (now < start_ns && start_ns < next) { next = start_ns; }
+      timeout = next > now ? (int) ((next - now) / 1000000) : 0;
+      n = epoll_wait(worker->epfd, events, LOAD_EVENTS, timeout);
+      for (i = 0; i < n; i++) {
+         user_receive(worker, (LoadUser *)events[i].data.ptr);
+      }
+   }
+
+   for (i = 0; i < worker->num_users; i++) {
+      user = &worker->users[i];
+      if (user->state != USER_DEAD) { user_send(user, EXIT, "/exit"); }
+      if (user->fd != -1) { close(user->fd); }
+      free(user->rx_buf);
+   }
+   return NULL;
+}
+
+
+/* Print the command line options and quit */
+static void usage(char *name) {
+   printf("%s --- Error:%s Usage: %s IP_ADDRESS PORT [-u USERS] [-r ROOMS] [-m MESSAGES_PER_SECOND]"
+          " [-d SECONDS] [-t THREADS] [-c COMMAND_PERCENT] [-n NAME_PREFIX] [-f].\n", RED, NORMAL, name);
+   exit(0);
+}
+
+
+int main(int argc, char **argv) {
+   int opt, i, j;
+   int num_users = LOAD_USERS;
+   int num_threads = LOAD_THREADS;
+   int seconds = LOAD_SECONDS;
+   uint64_t ready = 0, sent = 0, received = 0, commands = 0, errors = 0;
+   uint64_t latency[LAT_BUCKETS] = { 0 };
+   uint64_t interval;
+   LoadWorker *workers;
+   LoadUser *users;
+   double elapsed;
+
+   // -u users are spread over -r rooms, each sending -m messages a second for -d seconds
+   // -c percent of their actions are /who, /who all or /list instead, -f uses the framed protocol
+   while ((opt = getopt(argc, argv, "u:r:m:d:t:c:n:f")) != -1) {
+      switch (opt) {
+         case 'u':
+            num_users = atoi(optarg);
+            break;
+         case 'r':
+            num_rooms = atoi(optarg);
+            break;
+         case 'm':
+            rate = atof(optarg);
+            break;
+         case 'd':
+            seconds = atoi(optarg);
+            break;
+         case 't':
+            num_threads = atoi(optarg);
+            break;
+         case 'c':
+            command_percent = atoi(optarg);
+            break;
+         case 'n':
+            prefix = optarg;
+            break;
+         case 'f':
+            framed = 1;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if (argc - optind < 2 || num_users < 1 || num_rooms < 1 || rate <= 0 || seconds < 1 || \
+       num_threads < 1 || command_percent < 0 || command_percent > 100 || strlen(prefix) > 16) {
+      usage(argv[0]);
+   }
+   host = argv[optind];
+   port = argv[optind + 1];
+   signal(SIGPIPE, SIG_IGN);
+   if (num_threads > num_users) { num_threads = num_users; }
+
+   // Users start chatting together once logins have had time to settle, spread over one interval
+   start_ns = now_ns() + LOAD_SETTLE * 1000000000ULL;
+   end_ns = start_ns + (uint64_t) seconds * 1000000000ULL;
+   interval = (uint64_t) (1e9 / rate);
+   users = (LoadUser *)calloc(num_users, sizeof(LoadUser));
+   workers = (LoadWorker *)calloc(num_threads, sizeof(LoadWorker));
+   for (i = 0; i < num_users; i++) {
+      users[i].id = i;
+      users[i].fd = -1;
+      users[i].seed = i;
+      users[i].next_send = start_ns + interval * i / num_users;
+      snprintf(users[i].name, sizeof(users[i].name), "%s%d", prefix, i);
+   }
+   for (i = 0, j = 0; i < num_threads; i++) {
+      workers[i].users = users + j;
+      workers[i].num_users = num_users / num_threads + (i < num_users % num_threads);
+      workers[i].epfd = epoll_create1(0);
+      j += workers[i].num_users;
+      if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i])) {
+         printf("%s --- Error:%s Worker thread not created.\n", RED, NORMAL);
+         exit(1);
+      }
+   }
+   for (i = 0; i < num_threads; i++) {
+      pthread_join(workers[i].thread, NULL);
+      ready += workers[i].ready;
+      sent += workers[i].sent;
+      received += workers[i].received;
+      commands += workers[i].commands;
+      errors += workers[i].errors;
+      for (j = 0; j < LAT_BUCKETS; j++) { latency[j] += workers[i].latency[j]; }
+      close(workers[i].epfd);
+   }
+
+   elapsed = seconds;
+   printf("users %d ready %llu rooms %d threads %d seconds %d protocol %s\n", num_users,
+          (unsigned long long) ready, num_rooms, num_threads, seconds, framed ? "framed" : "legacy");
+   printf("sent %llu (%.1f/s) received %llu (%.1f/s) commands %llu errors %llu\n",
+          (unsigned long long) sent, sent / elapsed, (unsigned long long) received, received / elapsed,
+          (unsigned long long) commands, (unsigned long long) errors);
+   printf("latency_us p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n",
+          (unsigned long long) lat_percentile(latency, received, 0.50),
+          (unsigned long long) lat_percentile(latency, received, 0.90),
+          (unsigned long long) lat_percentile(latency, received, 0.99),
+          (unsigned long long) lat_percentile(latency, received, 0.999),
+          (unsigned long long) lat_percentile(latency, received, 1.0));
+   free(workers);
+   free(users);
+   return errors ? 1 : 0;
+}
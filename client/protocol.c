@@ -0,0 +1,218 @@
+/*
+//   Program:             TBD Chat Client
+//   File Name:           protocol.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_client.h"
+
+extern volatile int protocol;
+
+/*
+ *Framed protocol layout, all integers in network byte order
+ *
+ *   uint32 length     bytes of payload after the header
+ *   uint16 type       option code, FRAME_MESSAGE for room messages
+ *   uint16 flags      FRAME_SERVER when the sender is the server, never from clients
+ *   uint32 room       room ID of a room message, 0 otherwise
+ *   uint32 sequence   room message sequence number, 0 when unused
+ *   uint32 timestamp
+ *
+ *The payload is [uint8 len][username][uint8 len][realname] followed by the
+ *text, the names are left out entirely when FRAME_SERVER is set.
+ */
+
+
+static void put16(char *p, uint16_t v) { v = htons(v); memcpy(p, &v, 2); }
+static void put32(char *p, uint32_t v) { v = htonl(v); memcpy(p, &v, 4); }
+static uint16_t get16(char *p) { uint16_t v; memcpy(&v, p, 2); return ntohs(v); }
+static uint32_t get32(char *p) { uint32_t v; memcpy(&v, p, 4); return ntohl(v); }
+
+
+/* Copy a packet into the fixed size legacy layout */
+static size_t encode_legacy(packet *pkt, char *out) {
+   legacy_packet *lp = (legacy_packet *)out;
+
+   memset(lp, 0, sizeof(legacy_packet));
+   lp->timestamp = pkt->timestamp;
+   lp->options = pkt->options;
+   strncpy(lp->buf, pkt->buf, sizeof(lp->buf) - 1);
+   strncpy(lp->username, pkt->username, sizeof(lp->username) - 1);
+   strncpy(lp->realname, pkt->realname, sizeof(lp->realname) - 1);
+   return sizeof(legacy_packet);
+}
+
+
+/*
+ *Write a packet as a frame, returns the number of bytes used.  Only the
+ *server sets FRAME_SERVER, a client always sends its names even if empty
+ */
+static size_t encode_frame(packet *pkt, char *out) {
+   size_t len = 0;
+   size_t ulen = strnlen(pkt->username, USERNAME_LENGTH - 1);
+   size_t rlen = strnlen(pkt->realname, REALNAME_LENGTH - 1);
+   size_t text = strnlen(pkt->buf, MESSAGE_LENGTH - 1);
+   char *payload = out + FRAME_HEADER;
+
+   payload[len++] = (char) ulen;
+   memcpy(payload + len, pkt->username, ulen);
+   len += ulen;
+   payload[len++] = (char) rlen;
+   memcpy(payload + len, pkt->realname, rlen);
+   len += rlen;
+   memcpy(payload + len, pkt->buf, text);
+   len += text;
+
+   put32(out, len);
+   if (pkt->options >= DEFAULT_ROOM) {
+      put16(out + 4, FRAME_MESSAGE);
+      put32(out + 8, pkt->options);
+   }
+   else {
+      put16(out + 4, pkt->options);
+      put32(out + 8, 0);
+   }
+   put16(out + 6, 0);
+   put32(out + 12, 0);
+   put32(out + 16, (uint32_t) pkt->timestamp);
+   return FRAME_HEADER + len;
+}
+
+
+/* Serialize a packet for the given protocol into out (at least MAX_FRAME bytes) */
+size_t encode_packet(int proto, packet *pkt, char *out) {
+   if (proto == PROTO_FRAMED) {
+      return encode_frame(pkt, out);
+   }
+   return encode_legacy(pkt, out);
+}
+
+
+/*
+ *Pull one packet off the front of data.  Returns the number of bytes
+ *consumed, 0 when more data is needed or -1 if the stream is malformed
+ */
+int decode_packet(int proto, char *data, size_t len, packet *pkt) {
+   legacy_packet lp;
+   uint32_t length;
+   size_t pos = 0, ulen, rlen, text;
+   char *payload;
+   uint16_t type, flags;
+
+   if (proto != PROTO_FRAMED) {
+      if (len < sizeof(legacy_packet)) { return 0; }
+      memcpy(&lp, data, sizeof(legacy_packet));
+      memset(pkt, 0, sizeof(packet));
+      pkt->timestamp = lp.timestamp;
+      pkt->options = lp.options;
+      memcpy(pkt->buf, lp.buf, sizeof(lp.buf));
+      pkt->buf[sizeof(lp.buf) - 1] = '\0';
+      memcpy(pkt->username, lp.username, sizeof(pkt->username));
+      pkt->username[sizeof(pkt->username) - 1] = '\0';
+      memcpy(pkt->realname, lp.realname, sizeof(pkt->realname));
+      pkt->realname[sizeof(pkt->realname) - 1] = '\0';
+      return sizeof(legacy_packet);
+   }
+
+   if (len < FRAME_HEADER) { return 0; }
+   length = get32(data);
+   if (length > MAX_FRAME - FRAME_HEADER) { return -1; }
+   if (len < FRAME_HEADER + length) { return 0; }
+
+   type = get16(data + 4);
+   flags = get16(data + 6);
+   payload = data + FRAME_HEADER;
+   memset(pkt, 0, sizeof(packet));
+   pkt->seq = get32(data + 12);
+   pkt->timestamp = (time_t) get32(data + 16);
+   // Only a room message may carry long text, so its room must not name a command
+   if (type == FRAME_MESSAGE && (get32(data + 8) < DEFAULT_ROOM || get32(data + 8) > INT_MAX)) { return -1; }
+   pkt->options = (type == FRAME_MESSAGE) ? (int) get32(data + 8) : type;
+
+   if (flags & FRAME_SERVER) {
+      strcpy(pkt->username, SERVER_NAME);
+      strcpy(pkt->realname, SERVER_NAME);
+   }
+   else {
+      if (length < 1) { return -1; }
+      ulen = (unsigned char) payload[pos++];
+      if (ulen >= USERNAME_LENGTH || pos + ulen + 1 > length) { return -1; }
+      memcpy(pkt->username, payload + pos, ulen);
+      pos += ulen;
+      rlen = (unsigned char) payload[pos++];
+      if (rlen >= REALNAME_LENGTH || pos + rlen > length) { return -1; }
+      memcpy(pkt->realname, payload + pos, rlen);
+      pos += rlen;
+   }
+
+   // Only room messages may carry more than a legacy buffer of text
+   text = length - pos;
+   if (text >= MESSAGE_LENGTH || (type != FRAME_MESSAGE && text >= BUFFERSIZE)) { return -1; }
+   memcpy(pkt->buf, payload + pos, text);
+   pkt->buf[text] = '\0';
+   return FRAME_HEADER + length;
+}
+
+
+/* Send a packet to the server in the negotiated protocol */
+int send_packet(int fd, packet *pkt) {
+   char out[MAX_FRAME];
+   size_t len = encode_packet(protocol, pkt, out);
+   size_t sent = 0;
+   ssize_t n;
+
+   while (sent < len) {
+      n = send(fd, out + sent, len - sent, MSG_NOSIGNAL);
+      if (n == -1 && errno == EINTR) { continue; }
+      if (n <= 0) { return -1; }
+      sent += n;
+   }
+   return sent;
+}
+
+
+/*
+ *Ask a freshly connected server for framed packets.  Servers that predate
+ *framing answer with an error, in which case the legacy packet is kept
+ */
+int negotiate_protocol(int fd) {
+   legacy_packet reply;
+   packet req;
+   struct timeval tv;
+   ssize_t n;
+
+   protocol = PROTO_LEGACY;
+   memset(&req, 0, sizeof(packet));
+   req.options = PROTOCOL;
+   req.timestamp = time(NULL);
+   sprintf(req.buf, "%d", PROTO_FRAMED);
+   if (send_packet(fd, &req) == -1) { return protocol; }
+
+   // Don't hang forever on a server that never answers
+   tv.tv_sec = NEGOTIATE_TIMEOUT;
+   tv.tv_usec = 0;
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   n = recv(fd, &reply, sizeof(legacy_packet), MSG_WAITALL);
+   tv.tv_sec = 0;
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+   if (n == sizeof(legacy_packet) && reply.options == PROTOCOL && atoi(reply.buf) == PROTO_FRAMED) {
+      protocol = PROTO_FRAMED;
+   }
+   return protocol;
+}
@@ -0,0 +1,155 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           auth.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+/*
+ *Passwords are hashed on a pool of their own rather than on the thread
+ *that read the packet, so a crowd of clients logging in at once cannot
+ *hold up the client threads and event loops serving chat.  Its queue is
+ *bounded, a check that finds it full is refused straight away.
+ *
+ *The result goes back to the thread that reads the connection, which is
+ *the only one to change the connection's state.  A client thread waits
+ *for it, an event loop is woken through its eventfd.  Either way no other
+ *packet of that connection is dispatched while the check runs, and a loop
+ *connection closed meanwhile stays open until the check is handed back.
+ */
+ThreadPool hash_pool;
+
+
+/* Hashing thread, runs the register, login or password change of one packet */
+static void *auth_run(void *ptr) {
+   AuthTask *task = (AuthTask *)ptr;
+   Connection *conn = task->conn;
+   uint64_t one = 1;
+
+   if (task->pkt.options == REGISTER) {
+      task->result = register_user(&task->pkt, conn->fd);
+   }
+   else if (task->pkt.options == LOGIN) {
+      task->result = login(&task->pkt, conn->fd);
+   }
+   else {
+      set_pass(&task->pkt, conn->fd);
+      task->result = 1;
+   }
+   // Timed up to the hand back, the wait on the queue and the hashing are what a client sees
+   count_command(task->pkt.options, task->start);
+
+   // Hand the result back to the reader of the connection
+   if (conn->polled) {
+      pthread_mutex_lock(&conn->loop->done_mutex);
+      task->next = conn->loop->done;
+      conn->loop->done = task;
+      pthread_mutex_unlock(&conn->loop->done_mutex);
+      while (write(conn->loop->wakefd, &one, sizeof(one)) == -1 && errno == EINTR) { }
+   }
+   else {
+      pthread_mutex_lock(&conn->tx_mutex);
+      conn->auth_done = task;
+      pthread_cond_signal(&conn->auth_cond);
+      pthread_mutex_unlock(&conn->tx_mutex);
+   }
+   return NULL;
+}
+
+
+/* Apply a finished check on the reader of its connection and release its packets */
+static void apply_auth(AuthTask *task) {
+   Connection *conn = task->conn;
+
+   if (task->pkt.options != SETPASS) {
+      conn->logged_in = task->result;
+   }
+   hold_packets(conn, 0);
+   free(task);
+}
+
+
+/* Start threads hashing threads with up to queue checks waiting for one */
+int start_hashing(int threads, int queue) {
+   if (create_thread_pool(&hash_pool, threads, queue) == -1) {
+      return -1;
+   }
+   server_log(LEVEL_INFO, "Started %d hashing threads", threads);
+   return 0;
+}
+
+
+/* Hand a register, login or password change to the hashing pool, refused when it is backed up */
+void submit_auth(Connection *conn, packet *pkt) {
+   AuthTask *task = (AuthTask *)malloc(sizeof(AuthTask));
+
+   task->conn = conn;
+   task->start = metrics_now();
+   memcpy(&task->pkt, pkt, sizeof(packet));
+   hold_packets(conn, 1);
+   if (thread_pool_submit(&hash_pool, auth_run, (void *)task) == -1) {
+      hold_packets(conn, 0);
+      free(task);
+      count_event(COUNT_AUTH_REFUSED, 1);
+      sendError("Server busy, try again shortly.", conn->fd);
+   }
+}
+
+
+/* Client thread, wait for the check its last packet started */
+void wait_auth(Connection *conn) {
+   AuthTask *task;
+
+   pthread_mutex_lock(&conn->tx_mutex);
+   while (conn->auth_done == NULL) {
+      pthread_cond_wait(&conn->auth_cond, &conn->tx_mutex);
+   }
+   task = conn->auth_done;
+   conn->auth_done = NULL;
+   pthread_mutex_unlock(&conn->tx_mutex);
+   apply_auth(task);
+}
+
+
+/* Event loop, apply the checks finished for its connections and carry on with their held packets */
+void finish_auths(EventLoop *loop, char *scratch) {
+   AuthTask *task, *next;
+   Connection *conn;
+   uint64_t count;
+
+   while (read(loop->wakefd, &count, sizeof(count)) == -1 && errno == EINTR) { }
+   pthread_mutex_lock(&loop->done_mutex);
+   task = loop->done;
+   loop->done = NULL;
+   pthread_mutex_unlock(&loop->done_mutex);
+
+   for (; task != NULL; task = next) {
+      next = task->next;
+      conn = task->conn;
+      apply_auth(task);
+      // Finish a teardown that was put off while the check ran
+      if (conn->hung_up) {
+         conn->hung_up = 0;
+         drop_client(conn);
+      }
+      else {
+         dispatch_held(conn, scratch);
+      }
+   }
+}
@@ -4,7 +4,7 @@
 //   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
 //   Date Started:        10/23/2014
 //   Compile:             gcc -Wall -l pthread linked_list.c server_clients.c chat_server.c -o chat_server
-//   Run:                 ./chat_server IP_ADDRESS PORT
+//   Run:                 ./chat_server IP_ADDRESS PORT [-e LOOP_THREADS]
 //
 //   The server for a simple chat utility
 //   TBDChat is a simple chat client and server using BSD sockets
@@ -26,62 +26,231 @@
 */
 #include "chat_server.h"
 
-int chat_serv_sock_fd; //server socket
+Listener *listeners; //server sockets
+int num_listeners = 1;
+static int loop_threads = 0;
 int numRooms = DEFAULT_ROOM;
-pthread_mutex_t registered_users_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t active_users_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t registered_users_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t active_users_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t rooms_lock = PTHREAD_RWLOCK_INITIALIZER;
 Node *registered_users_list;
 Node *active_users_list;
 Node *room_list;
+int outq_messages = OUTQ_MESSAGES;
+size_t outq_bytes = OUTQ_BYTES;
+int slow_policy = SLOW_DISCONNECT;
+ThreadPool client_pool;
+extern unsigned long slow_dropped;
+extern unsigned long slow_coalesced;
+extern unsigned long slow_disconnects;
+extern unsigned long presence_changes;
+extern unsigned long presence_notices;
 char const *server_MOTD = "Thanks for connecting to the TBDChat Demo Server."
                           " It's demo day!";
 
 
+/* Print the command line options and quit */
+static void usage(char *name) {
+   printf("%s --- Error:%s Usage: %s IP_ADDRESS PORT [-e LOOP_THREADS] [-t CLIENT_THREADS] [-w WAITING_CLIENTS]"
+          " [-l LISTENERS] [-k BACKLOG] [-c HASH_THREADS] [-d HASH_QUEUE] [-q QUEUE_MESSAGES] [-b QUEUE_BYTES] [-p disconnect|coalesce|drop]"
+          " [-a ADMIN_PORT] [-v error|warn|info|debug].\n", RED, NORMAL, name);
+   exit(0);
+}
+
+
 int main(int argc, char **argv) {
-   if(argc < 3) {
-      printf("%s --- Error:%s Usage: %s IP_ADDRESS PORT.\n", RED, NORMAL, argv[0]);
-      exit(0);
+   int opt, i;
+   int backlog = BACKLOG;
+   int client_threads = POOL_THREADS;
+   int waiting_clients = POOL_QUEUE;
+   int hash_threads = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+   int hash_queue = HASH_QUEUE;
+   int loaded;
+   char *admin_port = NULL;
+   struct timespec load_start, load_end;
+   sigset_t stop_signals;
+   pthread_t stopper;
+
+   if (hash_threads < 1) {
+      hash_threads = 1;
    }
 
-   signal(SIGINT, sigintHandler);
+   // -e runs the epoll event loop server with the given number of loop threads
+   // -t and -w size the client threads of the blocking server and the clients waiting for one
+   // -l accepts on that many SO_REUSEPORT sockets, each with a thread and a backlog of -k
+   // -c and -d size the password hashing threads (default half the cores) and the checks waiting for one
+   // -q, -b and -p bound the output queued for a client and pick what happens past that
+   // -a serves a metrics dump to connections on that port of the loopback address
+   // -v picks the most verbose level of server output, debug dumps every packet
+   while ((opt = getopt(argc, argv, "e:t:w:l:k:c:d:q:b:p:a:v:")) != -1) {
+      switch (opt) {
+         case 'e':
+            loop_threads = atoi(optarg);
+            break;
+         case 't':
+            client_threads = atoi(optarg);
+            break;
+         case 'w':
+            waiting_clients = atoi(optarg);
+            break;
+         case 'l':
+            num_listeners = atoi(optarg);
+            break;
+         case 'k':
+            backlog = atoi(optarg);
+            break;
+         case 'c':
+            hash_threads = atoi(optarg);
+            break;
+         case 'd':
+            hash_queue = atoi(optarg);
+            break;
+         case 'q':
+            outq_messages = atoi(optarg);
+            break;
+         case 'b':
+            outq_bytes = strtoul(optarg, NULL, 10);
+            break;
+         case 'p':
+            if (strcmp(optarg, "disconnect") == 0) { slow_policy = SLOW_DISCONNECT; }
+            else if (strcmp(optarg, "coalesce") == 0) { slow_policy = SLOW_COALESCE; }
+            else if (strcmp(optarg, "drop") == 0) { slow_policy = SLOW_DROP; }
+            else { usage(argv[0]); }
+            break;
+         case 'a':
+            admin_port = optarg;
+            break;
+         case 'v':
+            if ((log_level = parse_log_level(optarg)) == -1) { usage(argv[0]); }
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if(argc - optind < 2 || hash_threads < 1 || hash_queue < 1 || outq_messages < 1 || outq_bytes < MAX_FRAME || \
+      client_threads < 1 || waiting_clients < 1 || num_listeners < 1 || backlog < 1) {
+      usage(argv[0]);
+   }
+
+   // SIGINT is left to signal_run, every thread started from here keeps it blocked
+   sigemptyset(&stop_signals);
+   sigaddset(&stop_signals, SIGINT);
+   pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+   if (start_logger() == -1) {
+      exit(1);
+   }
+   init_connections();
+   if (start_metrics(admin_port) == -1 || start_room_log() == -1 || start_presence() == -1 || \
+       start_hashing(hash_threads, hash_queue) == -1) {
+      exit(1);
+   }
 
    room_list = NULL;
    registered_users_list = NULL;
    active_users_list = NULL;
+   createUserIndex(&registered_users_list);
+   createUserIndex(&active_users_list);
+   createRoomIndex(&room_list);
 
-   createRoom(&room_list, numRooms, DEFAULT_ROOM_NAME, rooms_mutex);
-   RprintList(&room_list, rooms_mutex);
+   createRoom(&room_list, numRooms++, DEFAULT_ROOM_NAME, &rooms_lock);
+   RprintList(&room_list, &rooms_lock);
 
-   readUserFile(&registered_users_list, USERS_FILE, registered_users_mutex);
-   printList(&registered_users_list, registered_users_mutex);
-   // Open server socket
-   chat_serv_sock_fd = get_server_socket(argv[1], argv[2]);
+   // Report how long the accounts took to load, they grow with every registration
+   clock_gettime(CLOCK_MONOTONIC, &load_start);
+   readUserFile(&registered_users_list, USERS_FILE, &registered_users_lock);
+   if (init_user_journal() == -1) {
+      exit(1);
+   }
+   loaded = listLength(&registered_users_list, &registered_users_lock);
+   clock_gettime(CLOCK_MONOTONIC, &load_end);
+   server_log(LEVEL_INFO, "Loaded %d registered users in %.3f ms", loaded, \
+          (load_end.tv_sec - load_start.tv_sec) * 1000.0 + (load_end.tv_nsec - load_start.tv_nsec) / 1000000.0);
+   // Start whatever serves the accepted clients
+   if (loop_threads > 0) {
+      if (start_event_loops(loop_threads) == -1) {
+         exit(1);
+      }
+   }
+   else {
+      if (start_flush_loop() == -1 || create_thread_pool(&client_pool, client_threads, waiting_clients) == -1) {
+         exit(1);
+      }
+      server_log(LEVEL_INFO, "Started %d client threads", client_threads);
+   }
 
-   // step 3: get ready to accept connections
-   if(start_server(chat_serv_sock_fd, BACKLOG) == -1) {
-      printf("start server error\n");
+   // Open server sockets, with several the kernel spreads new connections across them
+   listeners = (Listener *)calloc(num_listeners, sizeof(Listener));
+   for (i = 0; i < num_listeners; i++) {
+      listeners[i].id = i;
+      listeners[i].fd = get_server_socket(argv[optind], argv[optind + 1], num_listeners > 1);
+      // step 3: get ready to accept connections
+      if(listeners[i].fd == -1 || start_server(listeners[i].fd, backlog) == -1) {
+         server_log(LEVEL_ERROR, "Could not start server.");
+         exit(1);
+      }
+   }
+   for (i = 1; i < num_listeners; i++) {
+      if (pthread_create(&listeners[i].thread, NULL, accept_run, (void *)&listeners[i])) {
+         server_log(LEVEL_ERROR, "Listener thread not created.");
+         exit(1);
+      }
+      pthread_detach(listeners[i].thread);
+   }
+   server_log(LEVEL_INFO, "Accepting on %d listener%s", num_listeners, num_listeners > 1 ? "s" : "");
+   if (pthread_create(&stopper, NULL, signal_run, NULL)) {
+      server_log(LEVEL_ERROR, "Signal thread not created.");
       exit(1);
    }
-   //Main execution loop
+   pthread_detach(stopper);
+
+   //Main execution loop, the main thread serves the first listener
+   accept_run((void *)&listeners[0]);
+   close(listeners[0].fd);
+}
+
+
+/*
+ *Accept loop of one listener.  Each listener thread keeps to one core so
+ *the connections it accepts start out on the core that took them
+ */
+void *accept_run(void *ptr) {
+   Listener *listener = (Listener *)ptr;
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   cpu_set_t cpus;
+   int new_client;
+
+   if (num_listeners > 1 && cores > 0) {
+      CPU_ZERO(&cpus);
+      CPU_SET(listener->id % cores, &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+   }
    while(1) {
-      //Accept a connection, start a thread
-      int new_client = accept_client(chat_serv_sock_fd);
-      if(new_client != -1) {
-         pthread_t new_client_thread;
-         pthread_create(&new_client_thread, NULL, client_receive, (void *)&new_client);
+      // Event loop clients get non-blocking sockets straight from accept4
+      if (loop_threads > 0) {
+         new_client = accept_client(listener->fd, SOCK_NONBLOCK | SOCK_CLOEXEC);
+         if (new_client != -1) {
+            count_event(COUNT_ACCEPTED, 1);
+            event_loop_add(new_client);
+         }
+      }
+      //Accept a connection, hand it to the client threads
+      else {
+         new_client = accept_client(listener->fd, SOCK_CLOEXEC);
+         if (new_client != -1) { count_event(COUNT_ACCEPTED, 1); }
+         if(new_client != -1 && thread_pool_submit(&client_pool, client_receive, (void *)(intptr_t) new_client) == -1) {
+            turn_away(new_client);
+         }
       }
    }
-
-   close(chat_serv_sock_fd);
+   return NULL;
 }
 
 
 //Copied from Dr. Bi's example
-int get_server_socket(char *hostname, char *port) {
+int get_server_socket(char *hostname, char *port, int reuseport) {
    struct addrinfo hints, *servinfo, *p;
    int status;
-   int server_socket;
+   int server_socket = -1;
    int yes = 1;
 
    memset(&hints, 0, sizeof hints);
@@ -90,25 +259,34 @@ int get_server_socket(char *hostname, char *port) {
    hints.ai_flags = AI_PASSIVE;      // Flag for returning bindable socket addr for either ipv4/6
 
    if ((status = getaddrinfo(hostname, port, &hints, &servinfo)) != 0) {
-      printf("getaddrinfo: %s\n", gai_strerror(status));
+      server_log(LEVEL_ERROR, "getaddrinfo: %s", gai_strerror(status));
       exit(1);
    }
 
    for (p = servinfo; p != NULL; p = p ->ai_next) {
       // step 1: create a socket
       if((server_socket = socket(p->ai_family, p->ai_socktype,p->ai_protocol)) == -1) {
-         printf("socket socket \n");
+         server_log(LEVEL_ERROR, "Could not create socket.");
          continue;
       }
       // if the port is not released yet, reuse it.
       if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-         printf("socket option\n");
+         server_log(LEVEL_ERROR, "Could not set socket option.");
+         continue;
+      }
+      // let every listener bind the same address
+      if (reuseport && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+         server_log(LEVEL_ERROR, "Could not set socket option.");
+         close(server_socket);
+         server_socket = -1;
          continue;
       }
 
       // step 2: bind socket to an IP addr and port
       if (bind(server_socket, p->ai_addr, p->ai_addrlen) == -1) {
-         printf("socket bind \n");
+         server_log(LEVEL_ERROR, "Could not bind socket.");
+         close(server_socket);
+         server_socket = -1;
          continue;
       }
       break;
@@ -119,18 +297,32 @@ int get_server_socket(char *hostname, char *port) {
 }
 
 
+/* Tell a client every client thread is taken and hang up */
+void turn_away(int client) {
+   Connection *conn = open_connection(client);
+
+   count_event(COUNT_TURNED_AWAY, 1);
+   if (conn == NULL) {
+      close(client);
+      return;
+   }
+   sendError("Server is full, try again later.", client);
+   close_connection(conn);
+}
+
+
 /* Copied from Dr. Bi's example */
 int start_server(int serv_socket, int backlog) {
    int status = 0;
    if ((status = listen(serv_socket, backlog)) == -1) {
-      printf("socket listen error\n");
+      server_log(LEVEL_ERROR, "Could not listen on socket.");
    }
    return status;
 }
 
 
 /* Copied from Dr. Bi's example */
-int accept_client(int serv_sock) {
+int accept_client(int serv_sock, int flags) {
    int reply_sock_fd = -1;
    socklen_t sin_size = sizeof(struct sockaddr_storage);
    struct sockaddr_storage client_addr;
@@ -139,28 +331,43 @@ int accept_client(int serv_sock) {
    // accept a connection request from a client
    // the returned file descriptor from accept will be used
    // to communicate with this client.
-   if ((reply_sock_fd = accept(serv_sock,(struct sockaddr *)&client_addr, &sin_size)) == -1) {
-      printf("socket accept error\n");
+   if ((reply_sock_fd = accept4(serv_sock,(struct sockaddr *)&client_addr, &sin_size, flags)) == -1) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+         server_log(LEVEL_ERROR, "Could not accept connection.");
+      }
+      // Out of descriptors, give the clients being served a moment to leave
+      if (errno == EMFILE || errno == ENFILE) {
+         usleep(10000);
+      }
    }
    return reply_sock_fd;
 }
 
 
-/* Dump contents of received packet from client */
+/* Dump contents of received packet from client, only at debug level */
 void debugPacket(packet *rx_pkt) {
-   printf("%s --------------------- TPS REPORT --------------------- %s\n", CYAN, NORMAL);
-   printf("%s Timestamp: %s%lu\n", MAGENTA, NORMAL, rx_pkt->timestamp);
-   printf("%s User Name: %s%s\n", MAGENTA, NORMAL, rx_pkt->username);
-   printf("%s Real Name: %s%s\n", MAGENTA, NORMAL, rx_pkt->realname);
-   printf("%s Option: %s%d\n", MAGENTA, NORMAL, rx_pkt->options);
-   printf("%s Buffer: %s%s\n", MAGENTA, NORMAL, rx_pkt->buf);
-   printf("%s ------------------------------------------------------- %s\n", CYAN, NORMAL);
+   server_log(LEVEL_DEBUG, "%s --------------------- TPS REPORT --------------------- %s\n"
+              "%s Timestamp: %s%lu\n%s User Name: %s%s\n%s Real Name: %s%s\n%s Option: %s%d\n%s Buffer: %s%s\n"
+              "%s ------------------------------------------------------- %s", CYAN, NORMAL,
+              MAGENTA, NORMAL, rx_pkt->timestamp, MAGENTA, NORMAL, rx_pkt->username,
+              MAGENTA, NORMAL, rx_pkt->realname, MAGENTA, NORMAL, rx_pkt->options,
+              MAGENTA, NORMAL, rx_pkt->buf, CYAN, NORMAL);
 }
 
 
-/* Handle SIGINT (CTRL+C) */
-void sigintHandler(int sig_num) {
-   printf("\b\b%s --- Error:%s Forced Exit.\n", RED, NORMAL);
+/*
+ *Wait for SIGINT (CTRL+C) and shut the server down.  This runs as an
+ *ordinary thread rather than a signal handler, so it may take locks and join
+ *the log writers
+ */
+void *signal_run(void *ptr) {
+   sigset_t stop_signals;
+   int i, sig;
+
+   sigemptyset(&stop_signals);
+   sigaddset(&stop_signals, SIGINT);
+   while (sigwait(&stop_signals, &sig) != 0) { }
+   server_log(LEVEL_ERROR, "Forced Exit.");
 
    //Closing client sockets and freeing memory from user lists
    Node *temp = active_users_list;
@@ -171,10 +378,10 @@ void sigintHandler(int sig_num) {
    strcpy(ret.realname, SERVER_NAME);
    ret.timestamp = time(NULL);
 
-   printf("--------CLOSING ACTIVE USERS--------\n");
+   server_log(LEVEL_INFO, "--------CLOSING ACTIVE USERS--------");
    while(temp != NULL) {
       current = (User *) temp->data;
-      printf("Closing %s's socket\n", current->username);
+      server_log(LEVEL_DEBUG, "Closing %s's socket", current->username);
       next = temp->next;
       exit_client(&ret, current->sock);
       free(current);
@@ -183,13 +390,21 @@ void sigintHandler(int sig_num) {
    }
 
    temp = registered_users_list;
-   printf("--------EMPTYING REGISTERED USERS LIST--------\n");
+   server_log(LEVEL_INFO, "--------EMPTYING REGISTERED USERS LIST--------");
    while(temp != NULL) {
       next = temp->next;
       free(temp);
       temp = next;
    }
 
-   close(chat_serv_sock_fd);
+   server_log(LEVEL_INFO, "Slow consumers: %lu chat lines dropped, %lu presence notices coalesced, %lu disconnected", \
+          slow_dropped, slow_coalesced, slow_disconnects);
+   server_log(LEVEL_INFO, "Presence: %lu joins and leaves sent as %lu notices", presence_changes, presence_notices);
+   stop_logger();
+   write_metrics(STDOUT_FILENO);
+   stop_room_log();
+   for (i = 0; i < num_listeners; i++) {
+      close(listeners[i].fd);
+   }
    exit(0);
 }
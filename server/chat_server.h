@@ -18,13 +18,19 @@
 #define CHAT_SERVER_H
 
 /* System Header Files */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             // accept4 and thread affinity
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -32,19 +38,74 @@
 #include <sys/wait.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <semaphore.h>
+#include <dirent.h>
+#include <ctype.h>
 #include <openssl/sha.h>
+#include <openssl/rand.h>
 /* Local Header Files */
 #include "linked_list.h"
+#include "logger.h"
 
 /* Preprocessor Macros */
 // Misc constants
-#define BACKLOG 2               // how many pending connections the queue will hold
-#define BUFFERSIZE 128
+#define BACKLOG 1024            // default pending connections each listener will hold
+#define POOL_THREADS 256        // default client threads of the blocking server
+#define POOL_QUEUE 256          // default accepted clients waiting for a client thread
+#define HASH_QUEUE 1024         // default password checks waiting for a hashing thread
+#define BUFFERSIZE 128          // text carried by a legacy packet
+#define MESSAGE_LENGTH 1024     // text carried by a framed room message
 #define SHA256_DIGEST 64
 #define DEFAULT_ROOM 1000
 #define DEFAULT_ROOM_NAME "Lobby"
 #define SERVER_NAME "SERVER"
 #define USERS_FILE "Users.bin"
+#define USERS_JOURNAL "Users.journal"
+#define USERS_JOURNAL_OLD "Users.journal.old"
+#define JOURNAL_COMPACT 4096    // journaled changes that trigger a compaction
+#define JOURNAL_INTERVAL 300    // s between compactions of a non empty journal
+#define LOG_BATCH 256           // queued room log lines that wake the log writer
+#define LOG_FLUSH_MS 100        // longest a room log line waits to be written
+#define LOG_IOV 256             // room log lines formatted per batch
+#define LOG_LINE (64 + REALNAME_LENGTH + MESSAGE_LENGTH)
+#define HISTORY_KEEP 256        // recent messages each room keeps in memory
+#define HISTORY_REPLAY 20       // recent messages sent to a user entering a room
+#define HISTORY_DIR "history"   // on disk room history, see history_store.c
+#define HISTORY_PATH 256
+#define HISTORY_SEGMENT 8388608 // bytes after which a history segment is closed
+#define HISTORY_INDEX_EVERY 64  // history records per sparse index entry
+#define HISTORY_QUERY_MAX 100   // messages returned by one history query
+#define HISTORY_CATCHUP 2000    // most stored messages replayed to a client catching up
+#define SEARCH_INDEX_SIZE 1024  // initial term slots of a room search index, power of two
+#define SEARCH_TERM 32          // longest search term kept, longer ones are cut
+#define SEARCH_MIN_TERM 2       // shorter terms are not indexed
+#define SEARCH_MAX_TERMS 8      // terms of a query that are used
+#define SEARCH_MAX 20           // messages returned by one search
+#define PRESENCE_MS 100         // joins and leaves in a room collected into one notice
+#define SESSION_TOKEN 32        // hex characters of a session resume token
+#define SESSION_TTL 300         // s a dropped session can be resumed
+#define SESSION_BUCKETS 4096
+#define METRICS_SUB 4           // latency histogram buckets per power of two
+#define METRICS_BUCKETS (METRICS_SUB * 32)
+#define METRICS_BACKLOG 16
+// Connection handling
+#define MAX_CONNECTIONS 262144  // upper bound on the connection table
+#define MAX_EVENTS 64           // epoll events handled per wakeup
+#define READ_CHUNK 65536        // bytes read from a socket per wakeup
+#define OUTQ_MESSAGES 4096      // default messages a connection may have waiting to be sent
+#define OUTQ_BYTES 1048576      // default bytes a connection may have waiting to be sent
+#define OUTQ_IOV 64             // queued messages handed to one sendmsg
+#define KEEPALIVE_IDLE 60       // s of silence before probing a client
+#define KEEPALIVE_INTERVAL 10   // s between probes
+#define KEEPALIVE_COUNT 3       // unanswered probes before the socket errors
 // Client options
 #define INVALID -1
 #define REGISTER 1
@@ -60,6 +121,19 @@
 #define LEAVE 11
 #define GETMOTD 12
 #define GETROOMS 13
+#define PROTOCOL 14
+#define GETHISTORY 15
+#define SEARCH 16
+#define RESUME 17
+// Metrics, see metrics.c.  Commands are counted by option code, room messages after them
+#define METRIC_MESSAGE (RESUME + 1)
+#define METRIC_COMMANDS (METRIC_MESSAGE + 1)
+#define COUNT_ACCEPTED 0
+#define COUNT_TURNED_AWAY 1
+#define COUNT_ERRORS 2
+#define COUNT_DELIVERIES 3
+#define COUNT_AUTH_REFUSED 4
+#define METRIC_COUNTERS 5
 // Server responses
 #define LOGSUC 100
 #define REGSUC 101
@@ -69,6 +143,25 @@
 #define MOTD 105
 #define INVITESUC 106
 #define SERV_ERR 107
+// Wire protocols
+#define PROTO_LEGACY 1          // fixed size legacy_packet
+#define PROTO_FRAMED 2          // length prefixed frames, see protocol.c
+#define PROTO_COUNT 3           // size of an array indexed by protocol
+#define FRAME_HEADER 20
+#define FRAME_MESSAGE 1000      // frame type of a room message
+#define FRAME_SERVER 0x1        // frame flag, sender names omitted
+#define MAX_FRAME (FRAME_HEADER + 2 + USERNAME_LENGTH + REALNAME_LENGTH + MESSAGE_LENGTH)
+
+// Slow consumer policies, each also applies the ones before it
+#define SLOW_DISCONNECT 0
+#define SLOW_COALESCE 1         // drop older queued presence notices
+#define SLOW_DROP 2             // drop the oldest queued chat lines
+
+// Kinds of queued message, replies are never dropped
+#define OUT_REPLY 0
+#define OUT_CHAT 1
+#define OUT_PRESENCE 2
+
 // Defined color constants
 #define NORMAL "\x1B[0m"
 #define BLACK "\x1B[30;1m"
@@ -83,23 +176,295 @@
 /* Structures */
 struct Packet {
    time_t timestamp;
-   char buf[BUFFERSIZE];
+   char buf[MESSAGE_LENGTH];
    char username[64];
    char realname[64];
    int options;
+   uint32_t seq;           // room message sequence number, framed protocol only
 };
 typedef struct Packet packet;
 
+// Packet as sent on the wire by clients that have not negotiated framing
+struct LegacyPacket {
+   time_t timestamp;
+   char buf[BUFFERSIZE];
+   char username[64];
+   char realname[64];
+   int options;
+};
+typedef struct LegacyPacket legacy_packet;
+
+// Encoded bytes shared by every queue they are waiting in
+struct out_msg {
+   int refs;
+   int kind;               // OUT_REPLY, OUT_CHAT or OUT_PRESENCE
+   uint32_t seq;           // room sequence number, 0 for anything but room messages
+   Room *log_room;         // room log the message is queued for, see room_log.c
+   struct out_msg *log_next;
+   size_t len;
+   char data[];
+};
+typedef struct out_msg OutMsg;
+
+// Work handed to a thread pool
+struct pool_task {
+   void *(*run)(void *);
+   void *arg;
+};
+typedef struct pool_task PoolTask;
+
+struct thread_pool {
+   int size;               // worker threads running
+   int idle;               // workers not running a task
+   int queue;              // tasks that may wait for a busy worker
+   PoolTask *tasks;        // queued tasks, oldest at head
+   int cap;
+   int head;
+   int count;
+   pthread_mutex_t mutex;
+   pthread_cond_t ready;
+};
+typedef struct thread_pool ThreadPool;
+
+// A password check for a hashing thread, handed back to the connection's reader when done, see auth.c
+struct auth_task {
+   struct connection *conn;
+   packet pkt;
+   int result;             // what register_user or login returned
+   uint64_t start;         // metrics_now() when it was submitted
+   struct auth_task *next;
+};
+typedef struct auth_task AuthTask;
+
+// Header of a message in a history segment, the framed message follows
+struct history_record {
+   uint32_t seq;
+   uint32_t ts;            // server time the message was logged
+   uint32_t len;
+};
+typedef struct history_record HistoryRecord;
+
+// Sparse history index entry, locates a record in its segment
+struct history_index {
+   uint32_t seq;
+   uint32_t ts;
+   uint32_t offset;
+};
+typedef struct history_index HistoryIndex;
+
+struct history_segment {
+   uint32_t first_seq;     // also names the segment's files
+   uint32_t first_ts;
+};
+typedef struct history_segment HistorySegment;
+
+// Search index term and the history sequence numbers it appears in
+struct search_term {
+   char *term;
+   uint32_t *postings;     // ascending
+   uint32_t count;
+   uint32_t cap;
+};
+typedef struct search_term SearchTerm;
+
+// Open addressing table of a room's search terms
+struct search_index {
+   pthread_rwlock_t lock;
+   SearchTerm **slots;
+   unsigned int size;      // always a power of two
+   unsigned int count;
+   uint32_t last_seq;      // newest message indexed, older ones are not taken again
+};
+typedef struct search_index SearchIndex;
+
+struct history_store {
+   char dir[sizeof(HISTORY_DIR) + ROOMNAME_LENGTH];
+   pthread_mutex_t mutex;  // guards the segment list and loaded
+   pthread_cond_t loaded_cond;
+   int loaded;             // segment list read and current segment open
+   HistorySegment *segments;
+   int num_segments;
+   int cap_segments;
+   // Current segment, only touched by the room log writer
+   int seg_fd;
+   int idx_fd;
+   uint32_t seg_first;
+   off_t seg_size;
+   uint32_t next_seq;
+   int since_index;        // records appended since the last index entry
+   SearchIndex search;
+   pthread_mutex_t index_mutex; // held while the writer indexes, guards search_ready
+   int search_ready;       // the index holds every stored message
+   struct history_store *next;
+};
+typedef struct history_store HistoryStore;
+
+// Joins and leaves of one room waiting for the presence thread
+struct presence_batch {
+   Room *room;
+   int joined;
+   int left;
+   char notice[BUFFERSIZE];      // sent as is for a single change
+   char names[BUFFERSIZE];       // " +joined -left" for each change
+   size_t names_len;
+   int names_full;
+   struct presence_batch *next;
+};
+typedef struct presence_batch PresenceBatch;
+
+// Login that can be taken over by a reconnecting client, see session.c
+struct session {
+   char token[SESSION_TOKEN + 1];
+   char username[USERNAME_LENGTH];
+   int roomID;             // room the user was in when the connection dropped
+   uint32_t seq;           // last message of that room queued for the user
+   time_t expires;         // 0 while a connection holds the session
+   struct session *next;
+};
+typedef struct session Session;
+
+// Metrics recorded by one thread
+struct metric_shard {
+   uint64_t calls[METRIC_COMMANDS];
+   uint64_t total_us[METRIC_COMMANDS];
+   uint64_t latency[METRIC_COMMANDS][METRICS_BUCKETS];
+   uint64_t counters[METRIC_COUNTERS];
+   struct metric_shard *next;
+};
+typedef struct metric_shard MetricShard;
+
+// Listening socket with its own accept thread, see -l
+struct listener {
+   int id;
+   int fd;
+   pthread_t thread;
+};
+typedef struct listener Listener;
+
+struct event_loop {
+   int id;
+   int epfd;
+   int wakefd;             // eventfd rung by the hashing threads, see auth.c
+   pthread_mutex_t done_mutex;
+   struct auth_task *done; // finished password checks for connections of this loop
+   pthread_t thread;
+};
+typedef struct event_loop EventLoop;
+
+struct connection {
+   int fd;
+   volatile int open;
+   int logged_in;
+   int proto;
+   char username[64];
+   char session[SESSION_TOKEN + 1];   // resume token handed out at login
+   EventLoop *loop;
+   pthread_mutex_t tx_mutex;
+   char *rx_buf;           // partial packet carried between reads
+   size_t rx_len;
+   int polled;             // read by its event loop rather than a client thread
+   int registered;         // descriptor is in the loop's epoll set
+   int want_out;           // loop is watching for the socket to become writable
+   int failed;             // output failed or overflowed, socket has been shut down
+   int auth_busy;          // a password check is running, further packets are held back
+   int hung_up;            // closed during the check, torn down once it is done
+   pthread_cond_t auth_cond;
+   struct auth_task *auth_done;   // finished check a client thread is waiting for
+   OutMsg **out_ring;      // messages waiting to be sent, oldest at out_head
+   unsigned int out_cap;
+   unsigned int out_head;
+   unsigned int out_count;
+   size_t out_offset;      // bytes of the oldest message already sent
+   size_t out_bytes;
+};
+typedef struct connection Connection;
 
 /* Function Prototypes */
 // chat_server.c
-int get_server_socket(char *hostname, char *port);
+int get_server_socket(char *hostname, char *port, int reuseport);
 int start_server(int serv_socket, int backlog);
+void *accept_run(void *ptr);
 void debugPacket(packet *rx_pkt);
-void sigintHandler(int sig_num);
-int accept_client(int serv_sock);
+void *signal_run(void *ptr);
+int accept_client(int serv_sock, int flags);
+void turn_away(int client);
+// connection.c
+void init_connections();
+Connection *open_connection(int fd);
+Connection *get_connection(int fd);
+void close_connection(Connection *conn);
+void logout_client(Connection *conn);
+void drop_client(Connection *conn);
+OutMsg *encode_message(int proto, packet *pkt);
+void release_message(OutMsg *msg);
+int send_packet(int fd, packet *pkt);
+int send_shared(int fd, packet *pkt, OutMsg **cache);
+int flush_connection(Connection *conn);
+int receive_packets(Connection *conn, char *scratch, size_t size);
+void hold_packets(Connection *conn, int hold);
+int dispatch_held(Connection *conn, char *scratch);
+void switch_protocol(Connection *conn, packet *ack, int proto);
+void connection_stats(int *open, unsigned long *messages, unsigned long *bytes);
+// protocol.c
+size_t encode_packet(int proto, packet *pkt, char *out);
+int decode_packet(int proto, char *data, size_t len, packet *pkt);
+int decode_request(int proto, char *data, size_t len, packet *pkt);
+// event_loop.c
+int start_event_loops(int count);
+int start_flush_loop();
+int event_loop_add(int fd);
+void *event_loop_run(void *ptr);
+// history.c
+OutMsg *stamp_message(Room *room, packet *pkt);
+void replay_history(Room *room, int fd);
+void send_history(Connection *conn, packet *pkt);
+void send_search(Connection *conn, packet *pkt);
+uint32_t history_position(Room *room);
+void replay_since(Room *room, uint32_t after, int fd);
+// history_store.c
+HistoryStore *get_history_store(Room *room);
+int history_searchable(HistoryStore *store);
+void append_history(Room *room, OutMsg **msgs, int count);
+int query_history(Room *room, time_t from, time_t to, OutMsg **out, int max);
+int read_history(Room *room, uint32_t *seqs, int count, OutMsg **out);
+// journal.c
+int init_user_journal();
+void journal_user(User *user);
+// auth.c
+int start_hashing(int threads, int queue);
+void submit_auth(Connection *conn, packet *pkt);
+void wait_auth(Connection *conn);
+void finish_auths(EventLoop *loop, char *scratch);
+// metrics.c
+uint64_t metrics_now();
+void count_command(int option, uint64_t start);
+void count_event(int counter, uint64_t n);
+void write_metrics(int fd);
+int start_metrics(char *port);
+// presence.c
+int start_presence();
+void announce_presence(packet *pkt, char *name, int joined);
+// room_log.c
+int start_room_log();
+void stop_room_log();
+size_t format_log_line(OutMsg *msg, char *line);
+void log_message(OutMsg *msg, Room *room);
+// thread_pool.c
+int create_thread_pool(ThreadPool *pool, int threads, int queue);
+int thread_pool_submit(ThreadPool *pool, void *(*run)(void *), void *arg);
+// search.c
+void init_search_index(SearchIndex *index);
+void index_message(SearchIndex *index, uint32_t seq, char *data, size_t len);
+int search_index(SearchIndex *index, char *query, uint32_t *seqs, int max);
+// session.c
+void open_session(User *user, char *token);
+void park_session(char *token, int roomID);
+void end_session(char *token);
+int resume_session(Connection *conn, packet *pkt);
 // server_clients.c
 void *client_receive(void *ptr);
+int process_packet(Connection *conn, packet *in_pkt);
+void negotiate_protocol(Connection *conn, packet *in_pkt);
 int sanitizeInput(char *buf, int type);
 int validUsername(char *username, int client);
 int validRealname(char *realname, int client);
@@ -120,8 +485,8 @@ void set_name(packet *pkt, int fd);
 void join(packet *pkt, int fd);
 void invite(packet *in_pkt, int fd);
 void leave(packet *pkt, int fd);
-void log_message(packet *pkt, int fd);
 //char *passEncrypt(char *s);
+void hashPassword(char *password, unsigned char *hash);
 int comparePasswords(unsigned char *pass1, unsigned char *pass2, int size);
 
 #endif
@@ -0,0 +1,618 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           connection.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+extern pthread_rwlock_t registered_users_lock;
+extern Node *registered_users_list;
+extern pthread_rwlock_t active_users_lock;
+extern Node *active_users_list;
+
+/*
+ *Connection state is indexed by socket descriptor.  Slots are allocated the
+ *first time a descriptor is seen and reused afterwards, so a pointer to a
+ *slot stays valid for the life of the server.
+ */
+Connection **connections;
+int max_connections;
+pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+extern int outq_messages;
+extern size_t outq_bytes;
+extern int slow_policy;
+
+// How often the slow consumer policy had to step in
+unsigned long slow_dropped = 0;
+unsigned long slow_coalesced = 0;
+unsigned long slow_disconnects = 0;
+
+static int write_queue(Connection *conn);
+static void discard_queue(Connection *conn);
+static int dispatch_packets(Connection *conn, char *buf, size_t total);
+
+
+/* Raise the descriptor limit as far as allowed and size the connection table */
+void init_connections() {
+   struct rlimit rl;
+
+   if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+      if (rl.rlim_cur < rl.rlim_max) {
+         rl.rlim_cur = rl.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &rl);
+         getrlimit(RLIMIT_NOFILE, &rl);
+      }
+      max_connections = (rl.rlim_cur == RLIM_INFINITY) ? MAX_CONNECTIONS : (int) rl.rlim_cur;
+   }
+   else {
+      max_connections = 1024;
+   }
+   if (max_connections > MAX_CONNECTIONS) { max_connections = MAX_CONNECTIONS; }
+   connections = (Connection **)calloc(max_connections, sizeof(Connection *));
+   server_log(LEVEL_INFO, "Connection table holds %d descriptors", max_connections);
+}
+
+
+/* Have the kernel probe idle sockets so vanished peers are noticed */
+static void set_keepalive(int fd) {
+   int yes = 1;
+   int idle = KEEPALIVE_IDLE;
+   int interval = KEEPALIVE_INTERVAL;
+   int count = KEEPALIVE_COUNT;
+
+   setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+   setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+
+/* Reset the connection slot for a freshly accepted socket */
+Connection *open_connection(int fd) {
+   Connection *conn;
+
+   if (fd < 0 || fd >= max_connections) {
+      server_log(LEVEL_ERROR, "Descriptor %d exceeds connection table.", fd);
+      return NULL;
+   }
+   pthread_mutex_lock(&connections_mutex);
+   conn = connections[fd];
+   if (conn == NULL) {
+      conn = (Connection *)calloc(1, sizeof(Connection));
+      pthread_mutex_init(&conn->tx_mutex, NULL);
+      pthread_cond_init(&conn->auth_cond, NULL);
+      connections[fd] = conn;
+   }
+   // The last owner of the slot may still be finishing up on another thread
+   pthread_mutex_lock(&conn->tx_mutex);
+   conn->fd = fd;
+   conn->logged_in = 0;
+   conn->proto = PROTO_LEGACY;
+   conn->loop = NULL;
+   memset(conn->username, 0, sizeof(conn->username));
+   memset(conn->session, 0, sizeof(conn->session));
+   free(conn->rx_buf);
+   conn->rx_buf = NULL;
+   conn->rx_len = 0;
+   conn->polled = 0;
+   conn->registered = 0;
+   conn->want_out = 0;
+   conn->failed = 0;
+   conn->auth_busy = 0;
+   conn->hung_up = 0;
+   conn->auth_done = NULL;
+   conn->out_offset = 0;
+   conn->open = 1;
+   pthread_mutex_unlock(&conn->tx_mutex);
+   pthread_mutex_unlock(&connections_mutex);
+   set_keepalive(fd);
+   return conn;
+}
+
+
+/* Return the open connection for a socket, NULL if there is none */
+Connection *get_connection(int fd) {
+   Connection *conn;
+
+   if (fd < 0 || fd >= max_connections) { return NULL; }
+   conn = connections[fd];
+   if (conn == NULL || !conn->open) { return NULL; }
+   return conn;
+}
+
+
+/*
+ *A password check still running on the hashing pool holds on to the
+ *connection, it is torn down once the check is handed back.  Returns 1
+ *when that is the case, having stopped watching the socket in the meantime
+ */
+static int defer_teardown(Connection *conn) {
+   int busy;
+
+   pthread_mutex_lock(&conn->tx_mutex);
+   busy = conn->auth_busy;
+   if (busy) {
+      conn->hung_up = 1;
+      if (conn->registered) {
+         epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+         conn->registered = 0;
+         conn->want_out = 0;
+      }
+   }
+   pthread_mutex_unlock(&conn->tx_mutex);
+   return busy;
+}
+
+
+/* Close the socket of a connection and release its buffers */
+void close_connection(Connection *conn) {
+   int fd;
+
+   if (defer_teardown(conn)) { return; }
+   pthread_mutex_lock(&conn->tx_mutex);
+   conn->open = 0;
+   // Last chance for queued replies such as the goodbye to go out
+   if (!conn->failed) { write_queue(conn); }
+   discard_queue(conn);
+   conn->want_out = 0;
+   conn->registered = 0;
+   free(conn->rx_buf);
+   conn->rx_buf = NULL;
+   conn->rx_len = 0;
+   fd = conn->fd;
+   pthread_mutex_unlock(&conn->tx_mutex);
+   // Once closed the descriptor, and with it this slot, can be handed to a new client
+   close(fd);
+}
+
+
+/* Remove the user on a connection from the active users and their room */
+void logout_client(Connection *conn) {
+   packet ret;
+   User *user;
+
+   if (conn->logged_in) {
+      // The client did not say goodbye, let it resume where it was for a while
+      user = get_user(&active_users_list, conn->username, &active_users_lock);
+      park_session(conn->session, user != NULL ? user->roomID : DEFAULT_ROOM);
+      memset(&ret, 0, sizeof(packet));
+      strcpy(ret.username, conn->username);
+      strncpy(ret.realname, get_real_name(&registered_users_list, conn->username, &registered_users_lock), \
+              sizeof(ret.realname) - 1);
+      ret.timestamp = time(NULL);
+      exit_client(&ret, conn->fd);
+      conn->logged_in = 0;
+   }
+}
+
+
+/* Tear down a client whose socket hung up or errored */
+void drop_client(Connection *conn) {
+   if (defer_teardown(conn)) { return; }
+   logout_client(conn);
+   close_connection(conn);
+}
+
+
+/* Encode a packet into a new message, the caller holds its one reference */
+OutMsg *encode_message(int proto, packet *pkt) {
+   char out[MAX_FRAME];
+   size_t len = encode_packet(proto, pkt, out);
+   OutMsg *msg = (OutMsg *)malloc(sizeof(OutMsg) + len);
+
+   msg->refs = 1;
+   msg->len = len;
+   msg->seq = pkt->seq;
+   // Room traffic may be shed from a slow queue, direct replies may not
+   if (pkt->options < DEFAULT_ROOM) { msg->kind = OUT_REPLY; }
+   else if (strcmp(pkt->username, SERVER_NAME) == 0) { msg->kind = OUT_PRESENCE; }
+   else { msg->kind = OUT_CHAT; }
+   memcpy(msg->data, out, len);
+   return msg;
+}
+
+
+/* Drop a reference to a message, freeing it with the last one */
+void release_message(OutMsg *msg) {
+   if (__sync_sub_and_fetch(&msg->refs, 1) == 0) {
+      free(msg);
+   }
+}
+
+
+/*
+ *Outbound queues.  Every reply goes through the queue of its connection,
+ *whatever is not taken by the socket right away waits there until the
+ *connection's event loop sees it writable.  The functions below expect
+ *the caller to hold tx_mutex.
+ */
+
+
+/* Start or stop watching for the socket to become writable */
+static void watch_writes(Connection *conn, int on) {
+   struct epoll_event ev;
+
+   if (conn->loop == NULL || conn->want_out == on) { return; }
+   // Client threads do their own reading, their loop only waits for writability once
+   if (!conn->polled && !on) {
+      conn->want_out = 0;
+      return;
+   }
+   memset(&ev, 0, sizeof(ev));
+   ev.data.ptr = conn;
+   if (conn->polled) {
+      ev.events = (conn->auth_busy ? 0 : EPOLLIN) | (on ? EPOLLOUT : 0);
+   }
+   else {
+      ev.events = EPOLLOUT | EPOLLONESHOT;
+   }
+   if (epoll_ctl(conn->loop->epfd, conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &ev) == 0) {
+      conn->registered = 1;
+      conn->want_out = on;
+   }
+}
+
+
+/* Release the oldest queued message */
+static void pop_message(Connection *conn) {
+   OutMsg *msg = conn->out_ring[conn->out_head];
+
+   conn->out_head = (conn->out_head + 1) % conn->out_cap;
+   conn->out_count--;
+   conn->out_bytes -= msg->len;
+   conn->out_offset = 0;
+   release_message(msg);
+}
+
+
+/* Throw away everything waiting on a connection */
+static void discard_queue(Connection *conn) {
+   while (conn->out_count) { pop_message(conn); }
+   free(conn->out_ring);
+   conn->out_ring = NULL;
+   conn->out_cap = 0;
+   conn->out_head = 0;
+   conn->out_bytes = 0;
+}
+
+
+/* Give up on the output of a connection, its reader sees the shutdown and cleans up */
+static void fail_connection(Connection *conn) {
+   if (!conn->failed) {
+      conn->failed = 1;
+      shutdown(conn->fd, SHUT_RDWR);
+   }
+   discard_queue(conn);
+}
+
+
+/* Send as much of the queue as the socket takes without blocking */
+static int write_queue(Connection *conn) {
+   struct iovec iov[OUTQ_IOV];
+   struct msghdr mh;
+   OutMsg *msg;
+   ssize_t n;
+   size_t left;
+   int i;
+
+   while (conn->out_count) {
+      for (i = 0; i < OUTQ_IOV && i < conn->out_count; i++) {
+         msg = conn->out_ring[(conn->out_head + i) % conn->out_cap];
+         iov[i].iov_base = msg->data + (i ? 0 : conn->out_offset);
+         iov[i].iov_len = msg->len - (i ? 0 : conn->out_offset);
+      }
+      memset(&mh, 0, sizeof(mh));
+      mh.msg_iov = iov;
+      mh.msg_iovlen = i;
+      n = sendmsg(conn->fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n == -1 && errno == EINTR) { continue; }
+      if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) { break; }
+      if (n <= 0) {
+         fail_connection(conn);
+         return -1;
+      }
+      // Retire every message the socket took completely
+      while (n > 0) {
+         msg = conn->out_ring[conn->out_head];
+         left = msg->len - conn->out_offset;
+         if ((size_t) n < left) {
+            conn->out_offset += n;
+            break;
+         }
+         n -= left;
+         pop_message(conn);
+      }
+   }
+   watch_writes(conn, conn->out_count > 0);
+   return 0;
+}
+
+
+/* True if msg would take a queue past its limits */
+static int over_limit(Connection *conn, OutMsg *msg) {
+   return conn->out_count >= outq_messages || conn->out_bytes + msg->len > outq_bytes;
+}
+
+
+/* Remove queued messages of one kind, oldest first, until msg fits.  Returns how many went */
+static int shed_messages(Connection *conn, OutMsg *msg, int kind) {
+   unsigned int count = conn->out_count;
+   unsigned int i, kept = 0;
+   int shed = 0;
+   OutMsg *m;
+
+   for (i = 0; i < count; i++) {
+      m = conn->out_ring[(conn->out_head + i) % conn->out_cap];
+      // A message already partly on the wire has to be finished
+      if (m->kind == kind && !(i == 0 && conn->out_offset) && over_limit(conn, msg)) {
+         conn->out_count--;
+         conn->out_bytes -= m->len;
+         release_message(m);
+         shed++;
+      }
+      else {
+         conn->out_ring[(conn->out_head + kept++) % conn->out_cap] = m;
+      }
+   }
+   return shed;
+}
+
+
+/* Apply the slow consumer policy until msg fits, returns 0 if the client has to go */
+static int make_room(Connection *conn, OutMsg *msg) {
+   int n;
+
+   if (!over_limit(conn, msg)) { return 1; }
+   if (slow_policy >= SLOW_COALESCE) {
+      if ((n = shed_messages(conn, msg, OUT_PRESENCE))) { __sync_add_and_fetch(&slow_coalesced, n); }
+   }
+   if (slow_policy >= SLOW_DROP && over_limit(conn, msg)) {
+      if ((n = shed_messages(conn, msg, OUT_CHAT))) { __sync_add_and_fetch(&slow_dropped, n); }
+   }
+   return !over_limit(conn, msg);
+}
+
+
+/* Add a message to the back of a queue, growing the ring as needed */
+static int queue_message(Connection *conn, OutMsg *msg) {
+   OutMsg **ring;
+   unsigned int i, cap;
+   int was_empty = (conn->out_count == 0);
+
+   if (!make_room(conn, msg)) {
+      server_log(LEVEL_ERROR, "Socket %d is not reading, disconnecting.", conn->fd);
+      __sync_add_and_fetch(&slow_disconnects, 1);
+      fail_connection(conn);
+      return -1;
+   }
+   if (conn->out_count == conn->out_cap) {
+      cap = conn->out_cap ? conn->out_cap * 2 : 16;
+      ring = (OutMsg **)malloc(cap * sizeof(OutMsg *));
+      for (i = 0; i < conn->out_count; i++) {
+         ring[i] = conn->out_ring[(conn->out_head + i) % conn->out_cap];
+      }
+      free(conn->out_ring);
+      conn->out_ring = ring;
+      conn->out_cap = cap;
+      conn->out_head = 0;
+   }
+   __sync_add_and_fetch(&msg->refs, 1);
+   conn->out_ring[(conn->out_head + conn->out_count) % conn->out_cap] = msg;
+   conn->out_count++;
+   conn->out_bytes += msg->len;
+
+   // Nothing ahead of it, so try the socket straight away
+   if (was_empty && write_queue(conn) == -1) { return -1; }
+   return msg->len;
+}
+
+
+/* Send a packet to a client through its outbound queue */
+int send_packet(int fd, packet *pkt) {
+   return send_shared(fd, pkt, NULL);
+}
+
+
+/*
+ *Send a packet to a client.  A room broadcast passes a cache indexed by
+ *protocol so the packet is encoded once per protocol and every member
+ *queue holds a reference to the same bytes.  The caller releases the
+ *cached messages once the broadcast is done.
+ */
+int send_shared(int fd, packet *pkt, OutMsg **cache) {
+   Connection *conn = get_connection(fd);
+   char out[MAX_FRAME];
+   OutMsg *msg;
+   size_t len;
+   int ret = -1;
+
+   if (conn == NULL) {
+      len = encode_packet(PROTO_LEGACY, pkt, out);
+      return send(fd, out, len, MSG_NOSIGNAL);
+   }
+   pthread_mutex_lock(&conn->tx_mutex);
+   if (conn->open && !conn->failed) {
+      if (cache == NULL) {
+         msg = encode_message(conn->proto, pkt);
+      }
+      else {
+         if (cache[conn->proto] == NULL) {
+            cache[conn->proto] = encode_message(conn->proto, pkt);
+         }
+         msg = cache[conn->proto];
+         __sync_add_and_fetch(&msg->refs, 1);
+      }
+      ret = queue_message(conn, msg);
+      release_message(msg);
+   }
+   pthread_mutex_unlock(&conn->tx_mutex);
+   return ret;
+}
+
+
+/* Send what a writable socket will take, returns 0 once its output has failed */
+int flush_connection(Connection *conn) {
+   int ret = 0;
+
+   pthread_mutex_lock(&conn->tx_mutex);
+   if (conn->open && !conn->failed) {
+      // A one shot watch has been used up by the event that got us here
+      if (!conn->polled) { conn->want_out = 0; }
+      ret = (write_queue(conn) == 0);
+   }
+   pthread_mutex_unlock(&conn->tx_mutex);
+   return ret;
+}
+
+
+/* Acknowledge a protocol request in the current protocol, then switch to the new one */
+void switch_protocol(Connection *conn, packet *ack, int proto) {
+   OutMsg *msg;
+
+   pthread_mutex_lock(&conn->tx_mutex);
+   if (conn->open && !conn->failed) {
+      msg = encode_message(conn->proto, ack);
+      queue_message(conn, msg);
+      release_message(msg);
+      conn->proto = proto;
+   }
+   pthread_mutex_unlock(&conn->tx_mutex);
+}
+
+
+/*
+ *Read whatever is available on a connection and dispatch every complete
+ *packet.  Partial packets are kept on the connection until the rest
+ *arrives.  End of file, a socket error (including a failed keepalive) or
+ *a malformed frame tears the client down.  Returns 1 while the connection
+ *is usable, 0 once it has closed.
+ */
+int receive_packets(Connection *conn, char *scratch, size_t size) {
+   size_t pending = conn->rx_len;
+   ssize_t n;
+
+   n = recv(conn->fd, scratch + pending, size - pending, 0);
+   if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return 1;
+   }
+   if (n <= 0) {
+      drop_client(conn);
+      return 0;
+   }
+
+   // Put the leftover bytes of the last read in front of the new data
+   if (pending) {
+      memcpy(scratch, conn->rx_buf, pending);
+      free(conn->rx_buf);
+      conn->rx_buf = NULL;
+      conn->rx_len = 0;
+   }
+   return dispatch_packets(conn, scratch, pending + n);
+}
+
+
+/*
+ *Dispatch every complete packet in buf.  Once a packet starts a password
+ *check nothing more is dispatched until it is done: a client thread waits
+ *for it, an event loop stops reading the socket and keeps the rest of buf
+ *for dispatch_held.  Returns 1 while the connection is usable
+ */
+static int dispatch_packets(Connection *conn, char *buf, size_t total) {
+   size_t offset = 0;
+   int used;
+   packet in_pkt;
+
+   // The protocol may change part way through the buffer after a PROTOCOL request
+   while ((used = decode_request(conn->proto, buf + offset, total - offset, &in_pkt)) > 0) {
+      offset += used;
+      if (!process_packet(conn, &in_pkt)) {
+         close_connection(conn);
+         return 0;
+      }
+      if (conn->auth_busy) {
+         if (conn->polled) { break; }
+         wait_auth(conn);
+      }
+   }
+   if (used == -1) {
+      server_log(LEVEL_ERROR, "Malformed frame on socket %d, disconnecting.", conn->fd);
+      drop_client(conn);
+      return 0;
+   }
+
+   // Hold on to a trailing partial packet, idle connections keep no buffer
+   if (offset < total) {
+      conn->rx_len = total - offset;
+      conn->rx_buf = (char *)malloc(conn->rx_len);
+      memcpy(conn->rx_buf, buf + offset, conn->rx_len);
+   }
+   return 1;
+}
+
+
+/* Dispatch the packets an event loop held back during a password check */
+int dispatch_held(Connection *conn, char *scratch) {
+   size_t total = conn->rx_len;
+
+   if (total == 0) { return 1; }
+   memcpy(scratch, conn->rx_buf, total);
+   free(conn->rx_buf);
+   conn->rx_buf = NULL;
+   conn->rx_len = 0;
+   return dispatch_packets(conn, scratch, total);
+}
+
+
+/* Hold back or release the packets of a connection while a password check runs */
+void hold_packets(Connection *conn, int hold) {
+   struct epoll_event ev;
+
+   pthread_mutex_lock(&conn->tx_mutex);
+   conn->auth_busy = hold;
+   // An event loop stops reading the socket until the check is done
+   if (conn->polled && conn->registered) {
+      memset(&ev, 0, sizeof(ev));
+      ev.data.ptr = conn;
+      ev.events = (hold ? 0 : EPOLLIN) | (conn->want_out ? EPOLLOUT : 0);
+      epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+   }
+   pthread_mutex_unlock(&conn->tx_mutex);
+}
+
+
+/* Open connections and the output waiting in their queues, for the metrics dump */
+void connection_stats(int *open, unsigned long *messages, unsigned long *bytes) {
+   Connection *conn;
+   int fd;
+
+   *open = 0;
+   *messages = 0;
+   *bytes = 0;
+   for (fd = 0; fd < max_connections; fd++) {
+      if ((conn = __atomic_load_n(&connections[fd], __ATOMIC_ACQUIRE)) == NULL) { continue; }
+      pthread_mutex_lock(&conn->tx_mutex);
+      if (conn->open) {
+         (*open)++;
+         *messages += conn->out_count;
+         *bytes += conn->out_bytes;
+      }
+      pthread_mutex_unlock(&conn->tx_mutex);
+   }
+}
@@ -0,0 +1,165 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           event_loop.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+EventLoop *event_loops;
+EventLoop flush_loop;
+int num_event_loops;
+static unsigned int next_loop;
+
+
+/* Watch the eventfd the hashing threads ring when a check of the loop is done */
+static int watch_wakeups(EventLoop *loop) {
+   struct epoll_event ev;
+
+   pthread_mutex_init(&loop->done_mutex, NULL);
+   loop->done = NULL;
+   if ((loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+      server_log(LEVEL_ERROR, "eventfd failed.");
+      return -1;
+   }
+   // Connections are never NULL, which marks the wakeups
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) == -1) {
+      server_log(LEVEL_ERROR, "Could not watch wakeups of loop %d.", loop->id);
+      return -1;
+   }
+   return 0;
+}
+
+
+/* Create the epoll instances and start one thread for each of them */
+int start_event_loops(int count) {
+   int i;
+
+   event_loops = (EventLoop *)calloc(count, sizeof(EventLoop));
+   for (i = 0; i < count; i++) {
+      event_loops[i].id = i;
+      if ((event_loops[i].epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+         server_log(LEVEL_ERROR, "epoll_create1 failed.");
+         return -1;
+      }
+      if (watch_wakeups(&event_loops[i]) == -1) {
+         return -1;
+      }
+      if (pthread_create(&event_loops[i].thread, NULL, event_loop_run, (void *)&event_loops[i])) {
+         server_log(LEVEL_ERROR, "Event loop thread not created.");
+         return -1;
+      }
+      pthread_detach(event_loops[i].thread);
+   }
+   num_event_loops = count;
+   server_log(LEVEL_INFO, "Started %d event loop threads", count);
+   return 0;
+}
+
+
+/* Start the loop that sends queued output for the client threads */
+int start_flush_loop() {
+   flush_loop.id = -1;
+   if ((flush_loop.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      server_log(LEVEL_ERROR, "epoll_create1 failed.");
+      return -1;
+   }
+   if (pthread_create(&flush_loop.thread, NULL, event_loop_run, (void *)&flush_loop)) {
+      server_log(LEVEL_ERROR, "Flush loop thread not created.");
+      return -1;
+   }
+   pthread_detach(flush_loop.thread);
+   return 0;
+}
+
+
+/* Hand an accepted non-blocking socket to the next event loop */
+int event_loop_add(int fd) {
+   struct epoll_event ev;
+   Connection *conn;
+   EventLoop *loop;
+
+   // The socket was made non-blocking by accept4
+   if ((conn = open_connection(fd)) == NULL) {
+      close(fd);
+      return -1;
+   }
+   loop = &event_loops[__sync_fetch_and_add(&next_loop, 1) % num_event_loops];
+   conn->loop = loop;
+   conn->polled = 1;
+   conn->registered = 1;
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.ptr = conn;
+   if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      server_log(LEVEL_ERROR, "Could not watch socket %d.", fd);
+      close_connection(conn);
+      return -1;
+   }
+   return 0;
+}
+
+
+/*
+ *Event loop thread.  Each connection belongs to exactly one loop, so its
+ *packets are read and dispatched in order by that loop alone.  The loop
+ *also sends whatever output the connection has queued once the socket is
+ *writable.  The flush loop runs the same code for the client threads but
+ *only ever sees writability, their threads do the reading.
+ */
+void *event_loop_run(void *ptr) {
+   EventLoop *loop = (EventLoop *)ptr;
+   struct epoll_event events[MAX_EVENTS];
+   char *scratch = (char *)malloc(READ_CHUNK);
+   Connection *conn;
+   int i, n;
+
+   while (1) {
+      n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+      if (n == -1) {
+         if (errno == EINTR) { continue; }
+         server_log(LEVEL_ERROR, "epoll_wait failed on loop %d.", loop->id);
+         break;
+      }
+      for (i = 0; i < n; i++) {
+         conn = (Connection *)events[i].data.ptr;
+         if (conn == NULL) {
+            finish_auths(loop, scratch);
+            continue;
+         }
+         // Skip events for a socket that was closed earlier in this batch
+         if (!conn->open || conn->loop != loop) { continue; }
+         if (events[i].events & EPOLLOUT) {
+            flush_connection(conn);
+         }
+         if (!conn->polled) { continue; }
+         if (events[i].events & EPOLLIN) {
+            if (!receive_packets(conn, scratch, READ_CHUNK)) { continue; }
+         }
+         if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+            drop_client(conn);
+         }
+      }
+   }
+   free(scratch);
+   return NULL;
+}
@@ -0,0 +1,263 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           history.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+extern pthread_rwlock_t rooms_lock;
+extern Node *room_list;
+
+/*
+ *Every room message is numbered by its room, the sequence number travels
+ *in the frame header and orders the room's history store, and a client
+ *that comes back can ask for what followed the last one it saw.  Every room
+ *keeps its last HISTORY_KEEP chat lines in memory as the framed OutMsg
+ *already built for its members, so catching up a user who joins or
+ *logs in is a matter of queueing references rather than reading the room
+ *log.  Join and leave notices are not kept.  Older messages are asked for
+ *with GETHISTORY and come from the room's history store, which SEARCH
+ *also reads.
+ */
+
+
+/*
+ *Number a room message and encode it, then hand it to the room log writer
+ *and keep it in the room's ring.  All of it happens under history_mutex so
+ *the log, and with it the history store, sees a room's messages in sequence
+ *order.  The caller gets the one reference it is to release
+ */
+OutMsg *stamp_message(Room *room, packet *pkt) {
+   OutMsg *msg, *old = NULL;
+
+   pthread_mutex_lock(&room->history_mutex);
+   pkt->seq = ++room->history_seq;
+   msg = encode_message(PROTO_FRAMED, pkt);
+   log_message(msg, room);
+   // Only chat lines are kept for replay, join and leave notices are not
+   if (msg->kind == OUT_CHAT) {
+      __sync_add_and_fetch(&msg->refs, 1);
+      if (room->history == NULL) {
+         room->history = (OutMsg **)calloc(HISTORY_KEEP, sizeof(OutMsg *));
+      }
+      if (room->history_count == HISTORY_KEEP) {
+         old = room->history[room->history_head];
+         room->history_head = (room->history_head + 1) % HISTORY_KEEP;
+         room->history_count--;
+      }
+      room->history[(room->history_head + room->history_count) % HISTORY_KEEP] = msg;
+      room->history_count++;
+   }
+   pthread_mutex_unlock(&room->history_mutex);
+   if (old != NULL) { release_message(old); }
+   return msg;
+}
+
+
+/* Queue stored messages for a client and drop the references to them */
+static void send_stored(OutMsg **msgs, int count, int fd) {
+   OutMsg *cache[PROTO_COUNT];
+   packet pkt;
+   int i;
+
+   for (i = 0; i < count; i++) {
+      // Framed clients share the stored copy, legacy ones get it rebuilt from it
+      memset(cache, 0, sizeof(cache));
+      cache[PROTO_FRAMED] = msgs[i];
+      if (decode_packet(PROTO_FRAMED, msgs[i]->data, msgs[i]->len, &pkt) > 0) {
+         send_shared(fd, &pkt, cache);
+      }
+      if (cache[PROTO_LEGACY] != NULL) { release_message(cache[PROTO_LEGACY]); }
+      release_message(msgs[i]);
+   }
+}
+
+
+/* Queue the last HISTORY_REPLAY messages of a room for a client */
+void replay_history(Room *room, int fd) {
+   OutMsg *recent[HISTORY_REPLAY];
+   int i, count, skip;
+
+   // Take references under the lock, queue them without it
+   pthread_mutex_lock(&room->history_mutex);
+   count = room->history_count < HISTORY_REPLAY ? room->history_count : HISTORY_REPLAY;
+   skip = room->history_count - count;
+   for (i = 0; i < count; i++) {
+      recent[i] = room->history[(room->history_head + skip + i) % HISTORY_KEEP];
+      __sync_add_and_fetch(&recent[i]->refs, 1);
+   }
+   pthread_mutex_unlock(&room->history_mutex);
+   send_stored(recent, count, fd);
+}
+
+
+/* Sequence number of the last message of a room */
+uint32_t history_position(Room *room) {
+   uint32_t seq;
+
+   pthread_mutex_lock(&room->history_mutex);
+   seq = room->history_seq;
+   pthread_mutex_unlock(&room->history_mutex);
+   return seq;
+}
+
+
+/* Queue the stored chat messages of a room numbered from first up to before end */
+static void replay_stored(Room *room, uint32_t first, uint32_t end, int fd) {
+   OutMsg *older[HISTORY_QUERY_MAX];
+   uint32_t seqs[HISTORY_QUERY_MAX];
+   int n, found, kept;
+
+   // One page at a time, so a long gap never needs more than a page in memory
+   while (first < end) {
+      for (n = 0; n < HISTORY_QUERY_MAX && first < end; n++) { seqs[n] = first++; }
+      found = read_history(room, seqs, n, older);
+      // The store also holds join and leave notices, which are not replayed
+      for (n = 0, kept = 0; n < found; n++) {
+         if (older[n]->len > FRAME_HEADER && (older[n]->data[7] & FRAME_SERVER)) { release_message(older[n]); }
+         else { older[kept++] = older[n]; }
+      }
+      send_stored(older, kept, fd);
+   }
+}
+
+
+/*
+ *Queue the chat messages of a room after sequence number after for a
+ *client.  What the ring still holds is shared from memory, the gap before
+ *it is read from the history store page by page.  A gap longer than
+ *HISTORY_CATCHUP is cut to its newest messages, and the client is told the
+ *first sequence number it gets
+ */
+void replay_since(Room *room, uint32_t after, int fd) {
+   OutMsg *recent[HISTORY_KEEP];
+   uint32_t oldest, from;
+   unsigned int i, count = 0;
+   packet ret;
+
+   pthread_mutex_lock(&room->history_mutex);
+   while (count < room->history_count && \
+          room->history[(room->history_head + room->history_count - count - 1) % HISTORY_KEEP]->seq > after) {
+      count++;
+   }
+   for (i = 0; i < count; i++) {
+      recent[i] = room->history[(room->history_head + room->history_count - count + i) % HISTORY_KEEP];
+      __sync_add_and_fetch(&recent[i]->refs, 1);
+   }
+   oldest = count ? recent[0]->seq : room->history_seq + 1;
+   pthread_mutex_unlock(&room->history_mutex);
+
+   if (after + 1 < oldest) {
+      from = after + 1;
+      if (oldest - from > HISTORY_CATCHUP) {
+         from = oldest - HISTORY_CATCHUP;
+         memset(&ret, 0, sizeof(packet));
+         ret.options = room->ID;
+         ret.seq = from;
+         strcpy(ret.username, SERVER_NAME);
+         strcpy(ret.realname, SERVER_NAME);
+         ret.timestamp = time(NULL);
+         sprintf(ret.buf, "History truncated, resuming from message %u.", from);
+         send_packet(fd, &ret);
+      }
+      replay_stored(room, from, oldest, fd);
+   }
+   send_stored(recent, count, fd);
+}
+
+
+/*
+ *Answer a GETHISTORY request, "FROM TO ROOM" with the times in seconds since
+ *the epoch, from a member of the room.  A count of what was found comes
+ *first, then the messages
+ */
+void send_history(Connection *conn, packet *pkt) {
+   OutMsg *found[HISTORY_QUERY_MAX];
+   long from = 0, to = 0;
+   int roomID = 0, count;
+   Room *room;
+   packet ret;
+   int fd = conn->fd;
+
+   if (sscanf(pkt->buf, "%ld %ld %d", &from, &to, &roomID) != 3 || from > to) {
+      sendError("Malformed history request.", fd);
+      return;
+   }
+   if ((room = Rget_roomFID(&room_list, roomID, &rooms_lock)) == NULL) {
+      sendError("No such room.", fd);
+      return;
+   }
+   if (!room_member(room, conn->username, fd)) {
+      sendError("You are not in that room.", fd);
+      return;
+   }
+   count = query_history(room, (time_t) from, (time_t) to, found, HISTORY_QUERY_MAX);
+
+   memset(&ret, 0, sizeof(packet));
+   ret.options = GETHISTORY;
+   strcpy(ret.username, SERVER_NAME);
+   strcpy(ret.realname, SERVER_NAME);
+   ret.timestamp = time(NULL);
+   sprintf(ret.buf, "%d Messages Found", count);
+   send_packet(fd, &ret);
+   send_stored(found, count, fd);
+}
+
+
+/*
+ *Answer a SEARCH request, "ROOM words", from a member of the room.  A count
+ *of the matches comes first, then the newest SEARCH_MAX messages holding
+ *every word.  While the room's older history is still being indexed only
+ *what is indexed is searched
+ */
+void send_search(Connection *conn, packet *pkt) {
+   uint32_t seqs[SEARCH_MAX];
+   OutMsg *found[SEARCH_MAX];
+   int roomID = 0, used = 0, count;
+   HistoryStore *store;
+   Room *room;
+   packet ret;
+   int fd = conn->fd;
+
+   if (sscanf(pkt->buf, "%d %n", &roomID, &used) != 1 || pkt->buf[used] == '\0') {
+      sendError("Malformed search request.", fd);
+      return;
+   }
+   if ((room = Rget_roomFID(&room_list, roomID, &rooms_lock)) == NULL) {
+      sendError("No such room.", fd);
+      return;
+   }
+   if (!room_member(room, conn->username, fd)) {
+      sendError("You are not in that room.", fd);
+      return;
+   }
+   store = get_history_store(room);
+   count = search_index(&store->search, pkt->buf + used, seqs, SEARCH_MAX);
+   count = read_history(room, seqs, count, found);
+
+   memset(&ret, 0, sizeof(packet));
+   ret.options = SEARCH;
+   strcpy(ret.username, SERVER_NAME);
+   strcpy(ret.realname, SERVER_NAME);
+   ret.timestamp = time(NULL);
+   // A store still being indexed answers from what is indexed so far
+   sprintf(ret.buf, history_searchable(store) ? "%d Matches Found" : "%d Matches Found so far", count);
+   send_packet(fd, &ret);
+   send_stored(found, count, fd);
+}
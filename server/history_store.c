@@ -0,0 +1,523 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           history_store.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+/*
+ *On disk room history.  Each room has a directory under HISTORY_DIR holding
+ *numbered segments, a segment is named after the sequence number of its
+ *first message and is closed once it passes HISTORY_SEGMENT bytes.
+ *
+ *   <seq>.seg   HistoryRecord headers, each followed by the framed message
+ *   <seq>.idx   HistoryIndex entry for the first and every HISTORY_INDEX_EVERY
+ *               record after it, giving the offset of that record
+ *
+ *A time range query binary searches the segments and then the sparse index
+ *of the first segment involved, so it reads from the first matching record
+ *on instead of scanning the room's whole past.  Only the room log writer
+ *appends, queries may run on any thread.  Stored messages also feed the
+ *room's search index, see search.c.  Opening a store only lists its
+ *segments, a thread of its own indexes what they already hold.
+ */
+static pthread_mutex_t stores_mutex = PTHREAD_MUTEX_INITIALIZER; // guards the stores list only
+static HistoryStore *stores = NULL;
+
+
+/* Path of a segment or index file of a store */
+static void segment_path(HistoryStore *store, uint32_t first_seq, char *ext, char *path) {
+   snprintf(path, HISTORY_PATH, "%s/%010u.%s", store->dir, first_seq, ext);
+}
+
+
+/* Read as much of len as the file has at off, returns the bytes read */
+static size_t read_at(int fd, void *buf, size_t len, off_t off) {
+   size_t done = 0;
+   ssize_t n;
+
+   while (done < len) {
+      n = pread(fd, (char *)buf + done, len - done, off + done);
+      if (n == -1 && errno == EINTR) { continue; }
+      if (n <= 0) { break; }
+      done += n;
+   }
+   return done;
+}
+
+
+/* Remember a segment in the store's list, kept in sequence order */
+static void add_segment(HistoryStore *store, uint32_t first_seq, uint32_t first_ts) {
+   pthread_mutex_lock(&store->mutex);
+   if (store->num_segments == store->cap_segments) {
+      store->cap_segments = store->cap_segments ? store->cap_segments * 2 : 16;
+      store->segments = (HistorySegment *)realloc(store->segments, store->cap_segments * sizeof(HistorySegment));
+   }
+   store->segments[store->num_segments].first_seq = first_seq;
+   store->segments[store->num_segments].first_ts = first_ts;
+   store->num_segments++;
+   pthread_mutex_unlock(&store->mutex);
+}
+
+
+/* Order segment file names by the sequence number they start at */
+static int compare_seq(const void *a, const void *b) {
+   uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+   return (x > y) - (x < y);
+}
+
+
+/*
+ *Open the last segment for appending.  Its tail is walked from the last
+ *index entry to find the next sequence number, a record torn by a crash is
+ *cut off
+ */
+static void resume_segment(HistoryStore *store, uint32_t first_seq) {
+   char path[HISTORY_PATH];
+   HistoryIndex entry;
+   HistoryRecord rec;
+   struct stat st;
+   off_t off = 0;
+   uint32_t seq = first_seq;
+
+   segment_path(store, first_seq, "idx", path);
+   store->idx_fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRWXU);
+   segment_path(store, first_seq, "seg", path);
+   store->seg_fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRWXU);
+   store->seg_first = first_seq;
+   store->since_index = 0;
+   if (fstat(store->idx_fd, &st) == 0 && st.st_size >= (off_t) sizeof(HistoryIndex)) {
+      read_at(store->idx_fd, &entry, sizeof(entry), st.st_size - st.st_size % sizeof(entry) - sizeof(entry));
+      off = entry.offset;
+      seq = entry.seq;
+   }
+   if (fstat(store->seg_fd, &st) == -1) { st.st_size = 0; }
+   // An index entry past the end of the segment cannot be trusted, walk it all
+   if (off > st.st_size) {
+      off = 0;
+      seq = first_seq;
+   }
+   while (read_at(store->seg_fd, &rec, sizeof(rec), off) == sizeof(rec) && rec.seq >= seq && \
+          off + (off_t) sizeof(rec) + rec.len <= st.st_size) {
+      off += sizeof(rec) + rec.len;
+      seq = rec.seq + 1;
+      store->since_index++;
+   }
+   if (off < st.st_size && ftruncate(store->seg_fd, off) == -1) {
+      server_log(LEVEL_ERROR, "Could not trim %s.", path);
+   }
+   store->seg_size = off;
+   store->next_seq = seq;
+   // The first record of a segment is always indexed
+   if (seq == first_seq) { store->since_index = HISTORY_INDEX_EVERY; }
+}
+
+
+/* Copy of the segment list, the caller frees it */
+static HistorySegment *copy_segments(HistoryStore *store, int *num) {
+   HistorySegment *segments;
+
+   // Segments are only ever added, a copy of the list is enough
+   pthread_mutex_lock(&store->mutex);
+   *num = store->num_segments;
+   segments = (HistorySegment *)malloc((*num + 1) * sizeof(HistorySegment));
+   memcpy(segments, store->segments, *num * sizeof(HistorySegment));
+   pthread_mutex_unlock(&store->mutex);
+   return segments;
+}
+
+
+/* Add every message of a segment to the room's search index */
+static void index_segment(HistoryStore *store, uint32_t first_seq) {
+   char path[HISTORY_PATH];
+   HistoryRecord rec;
+   struct stat st;
+   char *data;
+   off_t off = 0;
+   int fd;
+
+   segment_path(store, first_seq, "seg", path);
+   if ((fd = open(path, O_RDONLY)) == -1) { return; }
+   if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+         while (off + (off_t) sizeof(rec) <= st.st_size) {
+            memcpy(&rec, data + off, sizeof(rec));
+            if (off + (off_t) sizeof(rec) + rec.len > st.st_size) { break; }
+            index_message(&store->search, rec.seq, data + off + sizeof(rec), rec.len);
+            off += sizeof(rec) + rec.len;
+         }
+         munmap(data, st.st_size);
+      }
+   }
+   close(fd);
+}
+
+
+/* Load the list of segments a room already has on disk and open the last */
+static void load_store(HistoryStore *store) {
+   DIR *dir = opendir(store->dir);
+   struct dirent *ent;
+   uint32_t *seqs = NULL;
+   int count = 0, cap = 0, i, fd;
+   char path[HISTORY_PATH];
+   HistoryIndex entry;
+
+   if (dir == NULL) { return; }
+   while ((ent = readdir(dir)) != NULL) {
+      if (strlen(ent->d_name) != 14 || strcmp(ent->d_name + 10, ".seg") != 0) { continue; }
+      if (count == cap) {
+         cap = cap ? cap * 2 : 16;
+         seqs = (uint32_t *)realloc(seqs, cap * sizeof(uint32_t));
+      }
+      seqs[count++] = (uint32_t) strtoul(ent->d_name, NULL, 10);
+   }
+   closedir(dir);
+   qsort(seqs, count, sizeof(uint32_t), compare_seq);
+   for (i = 0; i < count; i++) {
+      entry.ts = 0;
+      segment_path(store, seqs[i], "idx", path);
+      if ((fd = open(path, O_RDONLY)) != -1) {
+         read_at(fd, &entry, sizeof(entry), 0);
+         close(fd);
+      }
+      add_segment(store, seqs[i], entry.ts);
+   }
+   if (count > 0) { resume_segment(store, seqs[count - 1]); }
+   free(seqs);
+}
+
+
+/*
+ *Index everything a store held when it was opened.  The writer does not
+ *index while this runs, so once the segments seen at the start are done the
+ *rest is caught up under index_mutex before the writer takes over
+ */
+static void *build_search(void *arg) {
+   HistoryStore *store = (HistoryStore *)arg;
+   HistorySegment *segments;
+   int num, i, from;
+
+   segments = copy_segments(store, &num);
+   for (i = 0; i < num; i++) {
+      index_segment(store, segments[i].first_seq);
+   }
+   from = num ? num - 1 : 0;
+   free(segments);
+
+   pthread_mutex_lock(&store->index_mutex);
+   segments = copy_segments(store, &num);
+   for (i = from; i < num; i++) {
+      index_segment(store, segments[i].first_seq);
+   }
+   store->search_ready = 1;
+   pthread_mutex_unlock(&store->index_mutex);
+   free(segments);
+   return NULL;
+}
+
+
+/* Read a new store's segment list, then index it without holding anyone up */
+static void open_store(HistoryStore *store) {
+   pthread_t builder;
+
+   mkdir(HISTORY_DIR, S_IRWXU);
+   mkdir(store->dir, S_IRWXU);
+   load_store(store);
+   pthread_mutex_lock(&store->mutex);
+   store->loaded = 1;
+   pthread_cond_broadcast(&store->loaded_cond);
+   pthread_mutex_unlock(&store->mutex);
+
+   if (pthread_create(&builder, NULL, build_search, (void *)store)) {
+      server_log(LEVEL_ERROR, "Search index thread not created, indexing %s in place.", store->dir);
+      build_search(store);
+      return;
+   }
+   pthread_detach(builder);
+}
+
+
+/*
+ *The history store of a room.  Rooms of the same name share one store, the
+ *first to ask adds it to the list and opens it outside stores_mutex while
+ *any others wait for that store alone
+ */
+HistoryStore *get_history_store(Room *room) {
+   char dir[sizeof(((HistoryStore *)0)->dir)];
+   HistoryStore *store;
+   int created = 0;
+
+   snprintf(dir, sizeof(dir), "%s/%.*s", HISTORY_DIR, ROOMNAME_LENGTH, room->name);
+   pthread_mutex_lock(&stores_mutex);
+   if ((store = room->store) == NULL) {
+      for (store = stores; store != NULL && strcmp(store->dir, dir) != 0; store = store->next) { }
+      if (store == NULL) {
+         store = (HistoryStore *)calloc(1, sizeof(HistoryStore));
+         pthread_mutex_init(&store->mutex, NULL);
+         pthread_cond_init(&store->loaded_cond, NULL);
+         pthread_mutex_init(&store->index_mutex, NULL);
+         store->seg_fd = -1;
+         store->idx_fd = -1;
+         store->next_seq = 1;
+         init_search_index(&store->search);
+         strcpy(store->dir, dir);
+         store->next = stores;
+         stores = store;
+         created = 1;
+      }
+      room->store = store;
+   }
+   pthread_mutex_unlock(&stores_mutex);
+
+   if (created) {
+      open_store(store);
+      return store;
+   }
+   pthread_mutex_lock(&store->mutex);
+   while (!store->loaded) {
+      pthread_cond_wait(&store->loaded_cond, &store->mutex);
+   }
+   pthread_mutex_unlock(&store->mutex);
+   return store;
+}
+
+
+/* Whether a store's search index holds all of its messages yet */
+int history_searchable(HistoryStore *store) {
+   int ready;
+
+   pthread_mutex_lock(&store->index_mutex);
+   ready = store->search_ready;
+   pthread_mutex_unlock(&store->index_mutex);
+   return ready;
+}
+
+
+/* Close the current segment and start the next one at next_seq */
+static void roll_segment(HistoryStore *store) {
+   if (store->seg_fd != -1) { close(store->seg_fd); }
+   if (store->idx_fd != -1) { close(store->idx_fd); }
+   resume_segment(store, store->next_seq);
+}
+
+
+/* Append a run of framed messages of one room.  Room log writer only */
+void append_history(Room *room, OutMsg **msgs, int count) {
+   HistoryStore *store = get_history_store(room);
+   HistoryRecord recs[LOG_IOV];
+   HistoryIndex entries[LOG_IOV];
+   struct iovec iov[2 * LOG_IOV];
+   uint32_t now = (uint32_t) time(NULL);
+   int i, n = 0, indexed = 0, since;
+   ssize_t len = 0, written;
+
+   // Messages are numbered by stamp_message, a new segment is named after the first
+   if (store->seg_fd == -1 || store->seg_size >= HISTORY_SEGMENT) {
+      store->next_seq = msgs[0]->seq;
+      roll_segment(store);
+      add_segment(store, store->seg_first, now);
+   }
+   since = store->since_index;
+   for (i = 0; i < count && i < LOG_IOV; i++) {
+      recs[i].seq = msgs[i]->seq;
+      store->next_seq = msgs[i]->seq + 1;
+      recs[i].ts = now;
+      recs[i].len = msgs[i]->len;
+      if (store->since_index >= HISTORY_INDEX_EVERY) {
+         entries[indexed].seq = recs[i].seq;
+         entries[indexed].ts = now;
+         entries[indexed].offset = store->seg_size + len;
+         indexed++;
+         store->since_index = 0;
+      }
+      store->since_index++;
+      iov[n].iov_base = &recs[i];
+      iov[n++].iov_len = sizeof(HistoryRecord);
+      iov[n].iov_base = msgs[i]->data;
+      iov[n++].iov_len = msgs[i]->len;
+      len += sizeof(HistoryRecord) + msgs[i]->len;
+   }
+   if ((written = writev(store->seg_fd, iov, n)) != len) {
+      server_log(LEVEL_ERROR, "Could not write history of %s.", room->name);
+      // Cut a torn record off, a segment that cannot be cut is left for a new one
+      if (written > 0 && ftruncate(store->seg_fd, store->seg_size) == -1) {
+         close(store->seg_fd);
+         store->seg_fd = -1;
+      }
+      store->since_index = since;
+      return;
+   }
+   store->seg_size += written;
+   // Until the store's past is indexed the builder picks these up from the segment
+   pthread_mutex_lock(&store->index_mutex);
+   if (store->search_ready) {
+      for (i = 0; i < count && i < LOG_IOV; i++) {
+         index_message(&store->search, recs[i].seq, msgs[i]->data, msgs[i]->len);
+      }
+   }
+   pthread_mutex_unlock(&store->index_mutex);
+   // Index entries go out after the records they point at
+   if (indexed && write(store->idx_fd, entries, indexed * sizeof(HistoryIndex)) == -1) {
+      server_log(LEVEL_ERROR, "Could not write history index of %s.", room->name);
+   }
+}
+
+
+/*
+ *Offset to start reading a segment at for a message logged at time key, or
+ *with sequence number key when by_seq is set.  0 if the index has nothing
+ *earlier
+ */
+static off_t seek_segment(HistoryStore *store, uint32_t first_seq, int by_seq, uint32_t key) {
+   char path[HISTORY_PATH];
+   HistoryIndex *entries;
+   struct stat st;
+   int fd, lo, hi, mid, n;
+   off_t off = 0;
+
+   segment_path(store, first_seq, "idx", path);
+   if ((fd = open(path, O_RDONLY)) == -1) { return 0; }
+   if (fstat(fd, &st) == 0 && (n = st.st_size / sizeof(HistoryIndex)) > 0) {
+      entries = (HistoryIndex *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (entries != MAP_FAILED) {
+         // Last entry before the key, messages logged in the same second may come earlier
+#define BEFORE(e) (by_seq ? (e).seq <= key : (e).ts < key)
+         lo = 0;
+         hi = n - 1;
+         while (lo < hi) {
+            mid = (lo + hi + 1) / 2;
+            if (BEFORE(entries[mid])) { lo = mid; }
+            else { hi = mid - 1; }
+         }
+         if (BEFORE(entries[lo])) { off = entries[lo].offset; }
+#undef BEFORE
+         munmap(entries, st.st_size);
+      }
+   }
+   close(fd);
+   return off;
+}
+
+
+/* Read the message of a record into a new OutMsg, NULL if it is cut short */
+static OutMsg *read_record(int fd, HistoryRecord *rec, off_t off) {
+   OutMsg *msg = (OutMsg *)malloc(sizeof(OutMsg) + rec->len);
+
+   if (read_at(fd, msg->data, rec->len, off + sizeof(HistoryRecord)) != rec->len) {
+      free(msg);
+      return NULL;
+   }
+   msg->refs = 1;
+   msg->kind = OUT_CHAT;
+   msg->len = rec->len;
+   return msg;
+}
+
+
+/*
+ *Fetch the messages with the given ascending sequence numbers.  Returns how
+ *many were put in out, each holds a reference
+ */
+int read_history(Room *room, uint32_t *seqs, int count, OutMsg **out) {
+   HistoryStore *store = get_history_store(room);
+   HistorySegment *segments;
+   HistoryRecord rec = { 0, 0, 0 };
+   char path[HISTORY_PATH];
+   int num, seg, open_seg = -1, lo, hi, mid, i, found = 0, fd = -1;
+   off_t off = 0;
+
+   segments = copy_segments(store, &num);
+   for (i = 0; i < count && num > 0; i++) {
+      // Last segment starting at or before the message
+      lo = 0;
+      hi = num - 1;
+      while (lo < hi) {
+         mid = (lo + hi + 1) / 2;
+         if (segments[mid].first_seq <= seqs[i]) { lo = mid; }
+         else { hi = mid - 1; }
+      }
+      seg = lo;
+      if (seg != open_seg) {
+         if (fd != -1) { close(fd); }
+         segment_path(store, segments[seg].first_seq, "seg", path);
+         fd = open(path, O_RDONLY);
+         open_seg = seg;
+         off = 0;
+      }
+      if (fd == -1) { continue; }
+      // Later messages in the same segment carry on from the last one
+      if (off == 0 || i == 0 || seqs[i - 1] >= seqs[i]) {
+         off = seek_segment(store, segments[seg].first_seq, 1, seqs[i]);
+      }
+      while (read_at(fd, &rec, sizeof(rec), off) == sizeof(rec) && rec.seq < seqs[i] && rec.len <= MAX_FRAME) {
+         off += sizeof(rec) + rec.len;
+      }
+      if (rec.seq == seqs[i] && rec.len <= MAX_FRAME && (out[found] = read_record(fd, &rec, off)) != NULL) {
+         found++;
+      }
+   }
+   if (fd != -1) { close(fd); }
+   free(segments);
+   return found;
+}
+
+
+/*
+ *Collect up to max messages of a room logged between from and to, oldest
+ *first.  Returns how many were put in out, each holds a reference
+ */
+int query_history(Room *room, time_t from, time_t to, OutMsg **out, int max) {
+   HistoryStore *store = get_history_store(room);
+   HistorySegment *segments;
+   HistoryRecord rec = { 0, 0, 0 };
+   OutMsg *msg;
+   char path[HISTORY_PATH];
+   int num, first, lo, hi, mid, i, fd, found = 0;
+   off_t off;
+
+   segments = copy_segments(store, &num);
+
+   // Last segment started before from, earlier ones are all older
+   lo = 0;
+   hi = num - 1;
+   while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (segments[mid].first_ts < from) { lo = mid; }
+      else { hi = mid - 1; }
+   }
+   first = lo;
+   for (i = first; i < num && found < max; i++) {
+      segment_path(store, segments[i].first_seq, "seg", path);
+      if ((fd = open(path, O_RDONLY)) == -1) { continue; }
+      off = (i == first) ? seek_segment(store, segments[i].first_seq, 0, (uint32_t) from) : 0;
+      while (found < max && read_at(fd, &rec, sizeof(rec), off) == sizeof(rec)) {
+         if (rec.ts > to || rec.len > MAX_FRAME) { break; }
+         if (rec.ts >= from) {
+            if ((msg = read_record(fd, &rec, off)) == NULL) { break; }
+            out[found++] = msg;
+         }
+         off += sizeof(rec) + rec.len;
+      }
+      close(fd);
+      if (rec.ts > to) { break; }
+   }
+   free(segments);
+   return found;
+}
@@ -0,0 +1,228 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           journal.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+extern pthread_rwlock_t registered_users_lock;
+extern Node *registered_users_list;
+
+/*
+ *Account changes are appended to USERS_JOURNAL as whole User records, the
+ *last record for a username wins.  A compaction thread periodically folds
+ *the journal into a fresh USERS_FILE snapshot.  The journal is renamed to
+ *USERS_JOURNAL_OLD while the snapshot is written, and as replaying a record
+ *twice is harmless a crash at any point leaves a loadable state.
+ */
+static int journal_fd = -1;
+static int journal_records = 0;
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+
+
+/* Apply every whole record of a journal file to the registered users */
+static int replay_journal(char *filename) {
+   int fd = open(filename, O_RDONLY);
+   int n, i;
+   struct stat st;
+   char *records;
+   User rec;
+   User *user;
+
+   if (fd == -1) { return 0; }
+   if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(User)) {
+      close(fd);
+      return 0;
+   }
+   records = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (records == MAP_FAILED) { return 0; }
+
+   // A torn record at the end of the file is ignored
+   n = st.st_size / sizeof(User);
+   for (i = 0; i < n; i++) {
+      memcpy(&rec, records + (size_t) i * sizeof(User), sizeof(User));
+      rec.username[USERNAME_LENGTH - 1] = '\0';
+      rec.real_name[REALNAME_LENGTH - 1] = '\0';
+      user = get_user(&registered_users_list, rec.username, &registered_users_lock);
+      if (user != NULL) {
+         memcpy(user->real_name, rec.real_name, sizeof(user->real_name));
+         memcpy(user->password, rec.password, sizeof(user->password));
+      }
+      else {
+         user = (User *)malloc(sizeof(User));
+         memcpy(user, &rec, sizeof(User));
+         user->sock = 0;
+         user->roomID = -1;
+         user->next = NULL;
+         insertUser(&registered_users_list, user, &registered_users_lock);
+      }
+   }
+   munmap(records, st.st_size);
+   return n;
+}
+
+
+/* Open a journal for appending, trimming a torn record left by a crash */
+static int open_journal(char *filename) {
+   int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, S_IRWXU);
+   struct stat st;
+
+   if (fd != -1 && fstat(fd, &st) == 0 && st.st_size % sizeof(User) != 0) {
+      if (ftruncate(fd, st.st_size - st.st_size % sizeof(User)) == -1) {
+         server_log(LEVEL_ERROR, "Could not trim %s.", filename);
+      }
+   }
+   return fd;
+}
+
+
+/* Write a buffer to a temporary file and move it over USERS_FILE */
+static int write_snapshot(char *data, size_t len) {
+   char tmp[] = USERS_FILE ".tmp";
+   int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+   size_t done = 0;
+   ssize_t n;
+
+   if (fd == -1) { return -1; }
+   while (done < len) {
+      n = write(fd, data + done, len - done);
+      if (n == -1 && errno == EINTR) { continue; }
+      if (n <= 0) {
+         close(fd);
+         unlink(tmp);
+         return -1;
+      }
+      done += n;
+   }
+   if (fsync(fd) == -1 || close(fd) == -1) {
+      unlink(tmp);
+      return -1;
+   }
+   return rename(tmp, USERS_FILE);
+}
+
+
+/*
+ *Fold the journal into a new snapshot.  Only the rotation and the copy of
+ *the user records happen under the locks, the file is written without them.
+ */
+static void compact_journal() {
+   Node *temp;
+   char *snapshot;
+   size_t count = 0, len = 0;
+   int old;
+
+   pthread_mutex_lock(&journal_mutex);
+   if (journal_records == 0) {
+      pthread_mutex_unlock(&journal_mutex);
+      return;
+   }
+   // An old journal still present means the last compaction failed, keep it
+   old = access(USERS_JOURNAL_OLD, F_OK) == 0;
+   if (!old) {
+      close(journal_fd);
+      rename(USERS_JOURNAL, USERS_JOURNAL_OLD);
+      journal_fd = open_journal(USERS_JOURNAL);
+   }
+   journal_records = 0;
+
+   pthread_rwlock_rdlock(&registered_users_lock);
+   for (temp = registered_users_list; temp != NULL; temp = temp->next) { count++; }
+   snapshot = (char *)malloc(count * sizeof(User) + 1);
+   for (temp = registered_users_list; temp != NULL; temp = temp->next) {
+      memcpy(snapshot + len, temp->data, sizeof(User));
+      len += sizeof(User);
+   }
+   pthread_rwlock_unlock(&registered_users_lock);
+   pthread_mutex_unlock(&journal_mutex);
+
+   if (write_snapshot(snapshot, len) == 0) {
+      unlink(USERS_JOURNAL_OLD);
+      server_log(LEVEL_INFO, "Compacted %zu users into %s", count, USERS_FILE);
+   }
+   else {
+      server_log(LEVEL_ERROR, "Could not write %s, journal kept.", USERS_FILE);
+   }
+   free(snapshot);
+}
+
+
+/* Compaction thread, runs when the journal fills up or on a timer */
+static void *journal_compact_run(void *ptr) {
+   struct timespec deadline;
+
+   while (1) {
+      pthread_mutex_lock(&journal_mutex);
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += JOURNAL_INTERVAL;
+      while (journal_records < JOURNAL_COMPACT) {
+         if (pthread_cond_timedwait(&journal_cond, &journal_mutex, &deadline) == ETIMEDOUT) { break; }
+      }
+      pthread_mutex_unlock(&journal_mutex);
+      compact_journal();
+   }
+   return NULL;
+}
+
+
+/* Replay the journals over the loaded snapshot and start appending */
+int init_user_journal() {
+   pthread_t compactor;
+   int replayed;
+
+   replayed = replay_journal(USERS_JOURNAL_OLD) + replay_journal(USERS_JOURNAL);
+   if ((journal_fd = open_journal(USERS_JOURNAL)) == -1) {
+      server_log(LEVEL_ERROR, "Could not open %s.", USERS_JOURNAL);
+      return -1;
+   }
+   journal_records = replayed;
+   if (replayed) {
+      server_log(LEVEL_INFO, "Replayed %d journaled account changes", replayed);
+   }
+   if (pthread_create(&compactor, NULL, journal_compact_run, NULL)) {
+      server_log(LEVEL_ERROR, "Journal compaction thread not created.");
+      return -1;
+   }
+   pthread_detach(compactor);
+   return 0;
+}
+
+
+/* Record the current state of an account with a single append */
+void journal_user(User *user) {
+   User rec;
+
+   pthread_rwlock_rdlock(&registered_users_lock);
+   memcpy(&rec, user, sizeof(User));
+   pthread_rwlock_unlock(&registered_users_lock);
+   rec.sock = 0;
+   rec.roomID = -1;
+   rec.next = NULL;
+
+   pthread_mutex_lock(&journal_mutex);
+   if (write(journal_fd, &rec, sizeof(User)) != sizeof(User)) {
+      server_log(LEVEL_ERROR, "Could not journal account %s.", rec.username);
+   }
+   if (++journal_records >= JOURNAL_COMPACT) {
+      pthread_cond_signal(&journal_cond);
+   }
+   pthread_mutex_unlock(&journal_mutex);
+}
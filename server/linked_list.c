@@ -20,545 +20,648 @@
 //   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
-#include "linked_list.h"
+#include "chat_server.h"
 
-extern int numRooms;
+/* Hash indexes attached to user lists, see createUserIndex */
+static UserIndex *user_indexes[MAX_USER_INDEXES];
+static int num_user_indexes = 0;
 
-int insertNode(Node **head, Node *new_node, pthread_mutex_t mutex) {
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
+/* Hash indexes attached to room lists, see createRoomIndex */
+static RoomIndex *room_indexes[MAX_ROOM_INDEXES];
+static int num_room_indexes = 0;
 
-   //If head is null, create new list
-   if(*head == NULL) {
-      new_node->next = NULL;
-      *head = new_node;
-      pthread_mutex_unlock(&mutex);
-      return 1;
+
+/* FNV-1a hash of a user or room name */
+static unsigned int hashName(char *name) {
+   unsigned int hash = 2166136261u;
+   while (*name) {
+      hash ^= (unsigned char) *name++;
+      hash *= 16777619u;
    }
-   //Advance cursor to end of list
-   while(temp->next != NULL) { temp = temp->next; }
+   return hash;
+}
 
-   //Append node
-   temp->next = new_node;
-   new_node->next = NULL;
-   pthread_mutex_unlock(&mutex);
-   return 1;
+
+/* Return the index attached to a list, NULL for plain lists */
+static UserIndex *findUserIndex(Node **head) {
+   int i;
+   for (i = 0; i < num_user_indexes; i++) {
+      if (user_indexes[i]->head == head) { return user_indexes[i]; }
+   }
+   return NULL;
 }
 
 
-/* Remove a node from list of node structs */
-int removeNode(Node **head, Node *to_remove, pthread_mutex_t mutex) {
-   pthread_mutex_lock(&mutex);
-   if(*head == NULL) {
-      printf("Cannot remove from an empty list\n");
-      pthread_mutex_unlock(&mutex);
-      return 0;
+/* Return the slot holding name, or the empty slot where it would go */
+static unsigned int indexProbe(UserIndex *index, char *name, unsigned int hash) {
+   unsigned int mask = index->size - 1;
+   unsigned int i = hash & mask;
+   struct user_slot *slot;
 
+   while (index->slots[i].node != NULL) {
+      slot = &index->slots[i];
+      if (slot->hash == hash && strcmp(((User *)slot->node->data)->username, name) == 0) {
+         return i;
+      }
+      i = (i + 1) & mask;
    }
+   return i;
+}
 
-   Node *temp = *head;
 
-   //Check if head is the node to be removed
-   if(temp == to_remove) {
-      *head = temp->next;
-      pthread_mutex_unlock(&mutex);
-      return 1;
+/* Double the slot array once the index is half full */
+static void indexGrow(UserIndex *index) {
+   struct user_slot *old = index->slots;
+   unsigned int old_size = index->size;
+   unsigned int i, j, mask;
+
+   index->size = old_size * 2;
+   index->slots = (struct user_slot *)calloc(index->size, sizeof(struct user_slot));
+   mask = index->size - 1;
+   for (i = 0; i < old_size; i++) {
+      if (old[i].node == NULL) { continue; }
+      j = old[i].hash & mask;
+      while (index->slots[j].node != NULL) { j = (j + 1) & mask; }
+      index->slots[j] = old[i];
    }
+   free(old);
+}
 
-   //Search list for node to be removed
-   while(temp->next != NULL) {
-      if(temp->next ==  to_remove) {
-         temp->next = temp->next->next;
-         pthread_mutex_unlock(&mutex);
-         return 1;
+
+/* Add a user node to an index, caller has checked it is not a duplicate */
+static void indexInsert(UserIndex *index, Node *node) {
+   char *name = ((User *)node->data)->username;
+   unsigned int hash = hashName(name);
+   unsigned int i;
+
+   if ((index->count + 1) * 2 > index->size) { indexGrow(index); }
+   i = indexProbe(index, name, hash);
+   index->slots[i].hash = hash;
+   index->slots[i].node = node;
+   index->count++;
+}
+
+
+/* Remove a username from an index, shifting back later entries of its probe run */
+static void indexRemove(UserIndex *index, char *name) {
+   unsigned int mask = index->size - 1;
+   unsigned int i = indexProbe(index, name, hashName(name));
+   unsigned int j = i, k;
+
+   if (index->slots[i].node == NULL) { return; }
+   index->slots[i].node = NULL;
+   index->count--;
+   while (1) {
+      j = (j + 1) & mask;
+      if (index->slots[j].node == NULL) { break; }
+      k = index->slots[j].hash & mask;
+      // Move the entry back unless its home slot lies in (i, j]
+      if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+         index->slots[i] = index->slots[j];
+         index->slots[j].node = NULL;
+         i = j;
       }
-      temp = temp->next;
    }
+}
 
-   printf("Specified node not found\n");
-   pthread_mutex_unlock(&mutex);
-   return 0;
+
+/* Grow an index ahead of time so count users fit without rehashing */
+static void indexReserve(UserIndex *index, unsigned int count) {
+   while (count * 2 > index->size) { indexGrow(index); }
 }
 
 
-/* Return length of list */
-int listLength(Node **head, pthread_mutex_t mutex) {
-   int i = 0;
+/* Attach a username hash index to a user list, lookups on it become constant time */
+UserIndex *createUserIndex(Node **head) {
+   UserIndex *index;
+
+   if (num_user_indexes == MAX_USER_INDEXES) { return NULL; }
+   index = (UserIndex *)malloc(sizeof(UserIndex));
+   index->head = head;
+   index->tail = NULL;
+   index->size = USER_INDEX_SIZE;
+   index->count = 0;
+   index->slots = (struct user_slot *)calloc(index->size, sizeof(struct user_slot));
+   user_indexes[num_user_indexes++] = index;
+   return index;
+}
 
-   if (*head == NULL) { return 0; }
 
-   Node *temp = *head;
-   while (temp->next != NULL) {
-      i++;
-      temp = temp->next;
+/* Find the node of a user in a list, caller holds the list lock */
+static Node *lookupUser(Node **head, char *user) {
+   UserIndex *index = findUserIndex(head);
+   Node *temp;
+   unsigned int i;
+
+   if (index != NULL) {
+      i = indexProbe(index, user, hashName(user));
+      return index->slots[i].node;
+   }
+   for (temp = *head; temp != NULL; temp = temp->next) {
+      if (strcmp(user, ((User *)temp->data)->username) == 0) { return temp; }
    }
-   return i + 1;
+   return NULL;
 }
 
 
-/* Insert a new user node into the list over user nodes passed in */
-int insertUser(Node **head, User *new_user, pthread_mutex_t mutex) {
-   pthread_mutex_lock(&mutex);
-   //printf("Inserting %s\n", new_user->username);
+/* Link a node onto the end of a list, caller holds the list lock */
+static void appendNode(Node **head, Node *new_node) {
+   UserIndex *index = findUserIndex(head);
    Node *temp = *head;
-   Node *new_node = (Node *)malloc(sizeof(Node));
-   new_node->data = (void *)new_user;
 
-   //Create new list if head is null
-   if (*head == NULL) {
+   new_node->next = NULL;
+   new_node->prev = NULL;
+   //If head is null, create new list
+   if(*head == NULL) {
       *head = new_node;
-      //printf("Insert Success\n");
-      pthread_mutex_unlock(&mutex);
-      return 1;
    }
-
-   User *temp_user = (User *)temp->data;
-
-   //Checks to ensure there are no duplicate users
-   if (strcmp(temp_user->username, new_user->username) == 0) {
-      //printf("Insert Failure\n");
-      pthread_mutex_unlock(&mutex);
-      return 0;
+   else {
+      //Indexed lists remember their tail, others advance cursor to end of list
+      if (index != NULL && index->tail != NULL) { temp = index->tail; }
+      while(temp->next != NULL) { temp = temp->next; }
+      temp->next = new_node;
+      new_node->prev = temp;
+   }
+   if (index != NULL) {
+      index->tail = new_node;
+      indexInsert(index, new_node);
    }
+}
 
-   while (temp->next != NULL) {
-      temp = temp->next;
-      temp_user = (User *)temp->data;
 
-      if (strcmp(temp_user->username, new_user->username) == 0) {
-         //printf("Insert Failure\n");
-         pthread_mutex_unlock(&mutex);
-         return 0;
-      }
-   }
+/* Unlink a node known to be in a list, caller holds the list lock */
+static void unlinkNode(Node **head, Node *node) {
+   UserIndex *index = findUserIndex(head);
 
-   //Add user to end of list
-   temp->next = new_node;
-   //printf("Insert Success\n");
-   pthread_mutex_unlock(&mutex);
-   return 1;
+   if (node->prev != NULL) { node->prev->next = node->next; }
+   else { *head = node->next; }
+   if (node->next != NULL) { node->next->prev = node->prev; }
+   if (index != NULL) {
+      if (index->tail == node) { index->tail = node->prev; }
+      indexRemove(index, ((User *)node->data)->username);
+   }
+   node->prev = NULL;
 }
 
 
-/* Remove a user node from the list of user nodes passed in */
-int removeUser(Node **head, User *user, pthread_mutex_t mutex) {
-   printf("Removing user: %s\n", user->username);
-   pthread_mutex_lock(&mutex);
-   Node *current = *head;
-   User *temp;
+int insertNode(Node **head, Node *new_node, pthread_rwlock_t *lock) {
+   pthread_rwlock_wrlock(lock);
+   appendNode(head, new_node);
+   pthread_rwlock_unlock(lock);
+   return 1;
+}
 
 
-   if (*head == NULL) {
-      printf("Can't remove from empty list.\n");
-      pthread_mutex_unlock(&mutex);
+/* Remove a node from list of node structs */
+int removeNode(Node **head, Node *to_remove, pthread_rwlock_t *lock) {
+   pthread_rwlock_wrlock(lock);
+   if(*head == NULL) {
+      server_log(LEVEL_DEBUG, "Cannot remove from an empty list");
+      pthread_rwlock_unlock(lock);
       return 0;
-   }
-   temp = (User *)current->data;
 
-   //Check if head is the user to be removed
-   if (strcmp(temp->username, user->username) == 0) {
-      pthread_mutex_unlock(&mutex);
-      removeNode(head, current, mutex);
-      printf("Potentially removed a user from a list.\n");
-      return 1;
    }
 
    //Search list for node to be removed
-   while (current->next != NULL) {
-      current = current->next;
-      temp = (User *)current->data;
-      if (strcmp(temp->username, user->username) == 0) {
-         pthread_mutex_unlock(&mutex);
-         removeNode(head, current, mutex);
-         printf("Potentially removed a user from a list.\n");
+   Node *temp = *head;
+   while(temp != NULL) {
+      if(temp == to_remove) {
+         unlinkNode(head, temp);
+         pthread_rwlock_unlock(lock);
          return 1;
       }
+      temp = temp->next;
    }
-   printf("User not found in list, nothing removed.\n");
-   pthread_mutex_unlock(&mutex);
+
+   server_log(LEVEL_DEBUG, "Specified node not found");
+   pthread_rwlock_unlock(lock);
    return 0;
 }
 
 
-/* Return the display name for given user name in the list */
-char *get_real_name(Node **head, char *user, pthread_mutex_t mutex) {
-   char *error = "ERROR";
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
+/* Return length of list */
+int listLength(Node **head, pthread_rwlock_t *lock) {
+   UserIndex *index = findUserIndex(head);
+   Node *temp;
+   int i = 0;
 
-   if (*head == NULL) {
-      pthread_mutex_unlock(&mutex);
-      return error;
+   pthread_rwlock_rdlock(lock);
+   if (index != NULL) {
+      i = index->count;
    }
-
-   //Iterate through list to search for user
-   User *current = (User *)temp->data;
-   if(strcmp(user, current->username) == 0){
-      pthread_mutex_unlock(&mutex);
-      return current->real_name;
+   else {
+      for (temp = *head; temp != NULL; temp = temp->next) { i++; }
    }
+   pthread_rwlock_unlock(lock);
+   return i;
+}
 
-   while(temp->next != NULL) {
-      temp = temp->next;
-      current = (User *)temp->data;
 
-      if(strcmp(user, current->username) == 0) {
-         pthread_mutex_unlock(&mutex);
-         return current->real_name;
-      }
-   }
+/* Insert a new user node into the list over user nodes passed in */
+int insertUser(Node **head, User *new_user, pthread_rwlock_t *lock) {
+   pthread_rwlock_wrlock(lock);
 
-   pthread_mutex_unlock(&mutex);
-   return error;
+   //Checks to ensure there are no duplicate users
+   if (lookupUser(head, new_user->username) != NULL) {
+      pthread_rwlock_unlock(lock);
+      return 0;
+   }
 
+   //Add user to end of list
+   Node *new_node = (Node *)malloc(sizeof(Node));
+   new_node->data = (void *)new_user;
+   appendNode(head, new_node);
+   pthread_rwlock_unlock(lock);
+   return 1;
 }
 
 
-/* Return stored password for user */
-unsigned char *get_password(Node  **head, char *user, pthread_mutex_t mutex) {
-   //char *error = "ERROR";
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
+/* Remove a user node from the list of user nodes passed in */
+int removeUser(Node **head, User *user, pthread_rwlock_t *lock) {
+   server_log(LEVEL_DEBUG, "Removing user: %s", user->username);
+   pthread_rwlock_wrlock(lock);
+   Node *current;
 
-   //Cannot get password from empty list
-   if(*head == NULL) {
-      pthread_mutex_unlock(&mutex);
-      return NULL;
+   if (*head == NULL) {
+      server_log(LEVEL_DEBUG, "Can't remove from empty list.");
+      pthread_rwlock_unlock(lock);
+      return 0;
    }
 
-   //Check if head is the requested user
-   User *current = (User *)temp->data;
-   if(strcmp(user, current->username) == 0){
-      pthread_mutex_unlock(&mutex);
-      return current->password;
+   current = lookupUser(head, user->username);
+   if (current == NULL) {
+      server_log(LEVEL_DEBUG, "User not found in list, nothing removed.");
+      pthread_rwlock_unlock(lock);
+      return 0;
    }
+   unlinkNode(head, current);
+   free(current);
+   pthread_rwlock_unlock(lock);
+   server_log(LEVEL_DEBUG, "Potentially removed a user from a list.");
+   return 1;
+}
 
-   //Search list for specified user
-   while(temp->next != NULL) {
-      temp = temp->next;
-      current = (User *)temp->data;
 
-      if(strcmp(user, current->username) == 0) {
-         pthread_mutex_unlock(&mutex);
-         return current->password;
-      }
-   }
-   pthread_mutex_unlock(&mutex);
-   return NULL;
+/* Return the display name for given user name in the list */
+char *get_real_name(Node **head, char *user, pthread_rwlock_t *lock) {
+   char *error = "ERROR";
+   pthread_rwlock_rdlock(lock);
+   Node *temp = lookupUser(head, user);
+   pthread_rwlock_unlock(lock);
+
+   if (temp == NULL) { return error; }
+   return ((User *)temp->data)->real_name;
 }
 
 
-/* Return node object pointing to user with username given */
-User *get_user(Node **head, char *user, pthread_mutex_t mutex) {
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
+/* Return stored password for user */
+unsigned char *get_password(Node  **head, char *user, pthread_rwlock_t *lock) {
+   pthread_rwlock_rdlock(lock);
+   Node *temp = lookupUser(head, user);
+   pthread_rwlock_unlock(lock);
 
-   //Cannot get user from empty list
-   if(*head == NULL) {
-      pthread_mutex_unlock(&mutex);
-      return NULL;
-   }
+   if (temp == NULL) { return NULL; }
+   return ((User *)temp->data)->password;
+}
 
-   //Search list for specified user
-   User *current = (User *)temp->data;
-   if(strcmp(user, current->username) == 0){
-      pthread_mutex_unlock(&mutex);
-      return current;
-   }
 
-   while(temp->next != NULL) {
-      temp = temp->next;
-      current = (User *)temp->data;
+/* Return node object pointing to user with username given */
+User *get_user(Node **head, char *user, pthread_rwlock_t *lock) {
+   pthread_rwlock_rdlock(lock);
+   Node *temp = lookupUser(head, user);
+   pthread_rwlock_unlock(lock);
 
-      if(strcmp(user, current->username) == 0) {
-         pthread_mutex_unlock(&mutex);
-         return current;
-      }
-   }
-   pthread_mutex_unlock(&mutex);
-   return NULL;
+   if (temp == NULL) { return NULL; }
+   return (User *)temp->data;
+}
 
+/* Check that a user is in a room from the given socket, returns 1 if so */
+int room_member(Room *room, char *user, int fd) {
+   User *member = get_user(&room->user_list, user, &room->user_list_lock);
+
+   return member != NULL && member->sock == fd;
 }
 
-/* Populate user list from Users.bin */
-void readUserFile(Node **head, char *filename, pthread_mutex_t mutex) {
+/* Populate user list from Users.bin, returns the number of users loaded */
+int readUserFile(Node **head, char *filename, pthread_rwlock_t *lock) {
    int fd = open(filename, O_RDONLY);
    int n;
    int i;
    struct stat st;
+   char *records;
    Node *temp;
    User *current;
+   UserIndex *index = findUserIndex(head);
    *head = NULL;
    if(fd == -1) {
-      close(fd);
-      return;
+      return 0;
    }
-   else {
-      fstat(fd, &st);
-      n = (st.st_size / sizeof(User));
-      //printf("n: %d\n", n);
-      for(i = 0; i < n; i++) {
-         temp = (Node *)malloc(sizeof(Node));
-         current = (User *)malloc(sizeof(User));
-         read(fd, current, sizeof(User));
-         current->roomID = -1;   //reset room ID between sessions
-         temp->data = current;
-         temp->next = NULL;
-         insertNode(head, temp, mutex);
-      }
+   // Map the whole file instead of reading it a record at a time
+   if(fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(User)) {
+      close(fd);
+      return 0;
    }
+   records = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
    close(fd);
+   if(records == MAP_FAILED) {
+      return 0;
+   }
+   madvise(records, st.st_size, MADV_SEQUENTIAL);
+   n = (st.st_size / sizeof(User));
+
+   pthread_rwlock_wrlock(lock);
+   // Size the index for every record up front so loading never rehashes
+   if(index != NULL) { indexReserve(index, n); }
+   for(i = 0; i < n; i++) {
+      current = (User *)malloc(sizeof(User));
+      memcpy(current, records + (size_t) i * sizeof(User), sizeof(User));
+      current->username[USERNAME_LENGTH - 1] = '\0';
+      current->real_name[REALNAME_LENGTH - 1] = '\0';
+      if(lookupUser(head, current->username) != NULL) {
+         free(current);
+         continue;
+      }
+      current->roomID = -1;   //reset room ID between sessions
+      current->next = NULL;
+      temp = (Node *)malloc(sizeof(Node));
+      temp->data = current;
+      appendNode(head, temp);
+   }
+   pthread_rwlock_unlock(lock);
+   munmap(records, st.st_size);
+   return listLength(head, lock);
 }
 
 
-/* Write user list to Users.bin */
-void writeUserFile(Node  **head, char *filename, pthread_mutex_t mutex) {
-   int fd = open(filename, O_WRONLY | O_CREAT, S_IRWXU);
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
+/* Log contents of list, only at debug level */
+void printList(Node **head, pthread_rwlock_t *lock) {
+   char hex[3 * 32 + 1];
+   User *current;
+   Node *temp;
+   int i;
 
+   if (!log_enabled(LEVEL_DEBUG)) { return; }
+   pthread_rwlock_rdlock(lock);
+   server_log(LEVEL_DEBUG, " --- Printing User List");
    if(*head == NULL) {
-      pthread_mutex_unlock(&mutex);
-      close(fd);
-      return;
+      server_log(LEVEL_DEBUG, "NULL");
    }
-
-   User *current = (User *)temp->data;
-   //printf("wrote: %s, %s, %s\n", temp->username, temp->real_name, temp->password);
-   write(fd, current, sizeof(User));
-   while(temp->next != NULL) {
-      temp = temp->next;
+   for (temp = *head; temp != NULL; temp = temp->next) {
       current = (User *)temp->data;
-      //printf("wrote: %s, %s, %s\n", temp->username, temp->real_name, temp->password);
-      write(fd, current, sizeof(User));
+      for (i = 0; i < 32; i++) {
+         sprintf(hex + 3 * i, "%02x:", current->password[i]);
+      }
+      server_log(LEVEL_DEBUG, "%s, %s, %d, room: %d %s", current->username, current->real_name, \
+                 current->sock, current->roomID, hex);
    }
-   pthread_mutex_unlock(&mutex);
+   pthread_rwlock_unlock(lock);
+   server_log(LEVEL_DEBUG, " --- End User List");
 }
 
 
-/* Print contents of list */
-void printList(Node **head, pthread_mutex_t mutex) {
+// ROOM METHODS
+
+
+/* Return the index attached to a room list, NULL for plain lists */
+static RoomIndex *findRoomIndex(Node **head) {
    int i;
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
-   printf(" --- Printing User List\n");
-   if(*head == NULL) {
-      printf("NULL\n");
-      pthread_mutex_unlock(&mutex);
-      return;
-   }
-   User *current = (User *)temp->data;
-   printf("%s, %s, %d, room: %d ", current->username, current->real_name, current->sock, current->roomID);
-   for (i = 0; i < 32; i++) {
-       printf("%02x",current->password[i]);
-       printf(":");
-   }
-   printf("\n");
-   while(temp->next != NULL) {
-      temp = temp->next;
-      current = temp->data;
-      printf("%s, %s, %d, room: %d ", current->username, current->real_name, current->sock, current->roomID);
-      for (i = 0; i < 32; i++) {
-          printf("%02x",current->password[i]);
-          printf(":");
-      }
-      printf("\n");
+   for (i = 0; i < num_room_indexes; i++) {
+      if (room_indexes[i]->head == head) { return room_indexes[i]; }
    }
+   return NULL;
+}
+
 
-   pthread_mutex_unlock(&mutex);
-   printf(" --- End User List\n");
+/* Hash of a room ID (Fibonacci hashing) */
+static unsigned int hashRoomID(int ID) {
+   return (unsigned int) ID * 2654435761u;
 }
 
 
-// ROOM METHODS
+/* Slot in the ID table holding ID, or the empty slot where it would go */
+static unsigned int roomProbeID(RoomIndex *index, int ID) {
+   unsigned int mask = index->size - 1;
+   unsigned int i = hashRoomID(ID) & mask;
 
+   while (index->by_id[i] != NULL && ((Room *)index->by_id[i]->data)->ID != ID) {
+      i = (i + 1) & mask;
+   }
+   return i;
+}
 
-/* Insert new room node to room list */
-int insertRoom(Node **head, Room *new_room, pthread_mutex_t mutex) {
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
-   Room *current;
 
-   //Create new list if head is null
-   if(*head == NULL) {
-      Node *new = (Node *)malloc(sizeof(Node));
-      new->data = (void *)new_room;
-      new->next = NULL;
-      *head = new;
-      pthread_mutex_unlock(&mutex);
-      return 1;
-   }
-   current = (Room *)temp->data;
-
-   //Iterate through list to make sure there are no duplicate room names
-   if(strcmp(current->name, new_room->name) == 0 || current->ID == new_room->ID) {
-      pthread_mutex_unlock(&mutex);
-      return 0;
+/* Slot in the name table holding name, or the empty slot where it would go */
+static unsigned int roomProbeName(RoomIndex *index, char *name) {
+   unsigned int mask = index->size - 1;
+   unsigned int i = hashName(name) & mask;
+
+   while (index->by_name[i] != NULL && strcmp(((Room *)index->by_name[i]->data)->name, name) != 0) {
+      i = (i + 1) & mask;
    }
+   return i;
+}
 
-   while(temp->next != NULL) {
-      temp = temp->next;
-      current = (Room *)temp->data;
 
-      if(strcmp(current->name, new_room->name) == 0 || current->ID == new_room->ID) {
-         pthread_mutex_unlock(&mutex);
-         return 0;
+/* Add a room node to both tables, doubling them once they are half full */
+static void roomIndexInsert(RoomIndex *index, Node *node) {
+   Node **old_id = index->by_id;
+   Node **old_name = index->by_name;
+   Room *room = (Room *)node->data;
+   unsigned int old_size = index->size;
+   unsigned int i;
+
+   if ((index->count + 1) * 2 > index->size) {
+      index->size = old_size * 2;
+      index->by_id = (Node **)calloc(index->size, sizeof(Node *));
+      index->by_name = (Node **)calloc(index->size, sizeof(Node *));
+      for (i = 0; i < old_size; i++) {
+         if (old_id[i] != NULL) {
+            index->by_id[roomProbeID(index, ((Room *)old_id[i]->data)->ID)] = old_id[i];
+         }
+         if (old_name[i] != NULL) {
+            index->by_name[roomProbeName(index, ((Room *)old_name[i]->data)->name)] = old_name[i];
+         }
       }
+      free(old_id);
+      free(old_name);
+   }
+   index->by_id[roomProbeID(index, room->ID)] = node;
+   index->by_name[roomProbeName(index, room->name)] = node;
+   index->count++;
+}
+
+
+/* Attach ID and name hash indexes to a room list, room lookups on it become constant time */
+RoomIndex *createRoomIndex(Node **head) {
+   RoomIndex *index;
+
+   if (num_room_indexes == MAX_ROOM_INDEXES) { return NULL; }
+   index = (RoomIndex *)malloc(sizeof(RoomIndex));
+   index->head = head;
+   index->tail = NULL;
+   index->size = ROOM_INDEX_SIZE;
+   index->count = 0;
+   index->by_id = (Node **)calloc(index->size, sizeof(Node *));
+   index->by_name = (Node **)calloc(index->size, sizeof(Node *));
+   room_indexes[num_room_indexes++] = index;
+   return index;
+}
+
+
+/* Find the node of a room by ID, caller holds the list lock */
+static Node *lookupRoomID(Node **head, int ID) {
+   RoomIndex *index = findRoomIndex(head);
+   Node *temp;
+
+   if (index != NULL) { return index->by_id[roomProbeID(index, ID)]; }
+   for (temp = *head; temp != NULL; temp = temp->next) {
+      if (((Room *)temp->data)->ID == ID) { return temp; }
    }
+   return NULL;
+}
 
-   //Insert room at the end of the list
+
+/* Find the node of a room by name, caller holds the list lock */
+static Node *lookupRoomName(Node **head, char *name) {
+   RoomIndex *index = findRoomIndex(head);
+   Node *temp;
+
+   if (index != NULL) { return index->by_name[roomProbeName(index, name)]; }
+   for (temp = *head; temp != NULL; temp = temp->next) {
+      if (strcmp(((Room *)temp->data)->name, name) == 0) { return temp; }
+   }
+   return NULL;
+}
+
+
+/* Insert new room node to room list */
+int insertRoom(Node **head, Room *new_room, pthread_rwlock_t *lock) {
+   RoomIndex *index = findRoomIndex(head);
+   Node *temp;
+
+   pthread_rwlock_wrlock(lock);
+   //Make sure there are no duplicate room names or IDs
+   if (lookupRoomName(head, new_room->name) != NULL || lookupRoomID(head, new_room->ID) != NULL) {
+      pthread_rwlock_unlock(lock);
+      return 0;
+   }
+
+   //Insert room at the end of the list, indexed lists remember their tail
    Node *new_node = (Node *)malloc(sizeof(Node));
    new_node->data = (void *)new_room;
    new_node->next = NULL;
-   temp->next = new_node;
-   pthread_mutex_unlock(&mutex);
+   new_node->prev = NULL;
+   if (*head == NULL) {
+      *head = new_node;
+   }
+   else {
+      temp = (index != NULL && index->tail != NULL) ? index->tail : *head;
+      while (temp->next != NULL) { temp = temp->next; }
+      temp->next = new_node;
+      new_node->prev = temp;
+   }
+   if (index != NULL) {
+      index->tail = new_node;
+      roomIndexInsert(index, new_node);
+   }
+   pthread_rwlock_unlock(lock);
    return 1;
 }
 
 
-/*Creates a new room and inserts it in the specified rooms list*/
-int createRoom(Node **head, int ID, char *name, pthread_mutex_t mutex) {
-   printf("Creating room %d %s\n", ID, name);
+/*Creates a new room with the given unique ID and inserts it in the specified rooms list*/
+int createRoom(Node **head, int ID, char *name, pthread_rwlock_t *lock) {
+   server_log(LEVEL_INFO, "Creating room %d %s", ID, name);
    Room *newRoom = (Room *) malloc(sizeof(Room));
    newRoom->ID = ID;
-   newRoom->user_list_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+   pthread_rwlock_init(&newRoom->user_list_lock, NULL);
    strncpy(newRoom->name, name, sizeof(newRoom->name));
    newRoom->user_list = NULL;
-   char *temp = (char*)malloc(strlen(newRoom->name) * sizeof(char));
+   newRoom->presence = NULL;
+   pthread_mutex_init(&newRoom->history_mutex, NULL);
+   newRoom->history = NULL;
+   newRoom->history_head = 0;
+   newRoom->history_count = 0;
+   newRoom->history_seq = 0;
+   newRoom->store = NULL;
+   char *temp = (char*)malloc((strlen(newRoom->name) + strlen(".log") + 1) * sizeof(char));
    strcpy(temp, newRoom->name);
    newRoom->fd = open(strncat(temp, ".log", 4), O_WRONLY | O_CREAT, S_IRWXU);
    lseek(newRoom->fd, 0, 2);
-   numRooms++;
-   return insertRoom(head, newRoom, mutex);
+   free(temp);
+   // Open the history store before anyone can post, numbering carries on from it
+   newRoom->history_seq = get_history_store(newRoom)->next_seq - 1;
+   // Another thread may have created a room with the same name first
+   if (!insertRoom(head, newRoom, lock)) {
+      close(newRoom->fd);
+      free(newRoom);
+      return 0;
+   }
+   return 1;
 }
 
 /* Return ID of room node from its name*/
-int Rget_ID(Node **head, char *name, pthread_mutex_t mutex) {
-   int error = -1;
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
-   Room *current;
+int Rget_ID(Node **head, char *name, pthread_rwlock_t *lock) {
+   pthread_rwlock_rdlock(lock);
+   Node *temp = lookupRoomName(head, name);
+   pthread_rwlock_unlock(lock);
 
-   //Cannot get ID from empty list
-   if(*head == NULL) {
-      pthread_mutex_unlock(&mutex);
-      return error;
-   }
-   current = (Room *)temp->data;
-
-   //Search room list for specified room
-   while(strcmp(name, current->name) != 0) {
-      if(temp->next == NULL) {
-         pthread_mutex_unlock(&mutex);
-         return error;
-      }
-      temp=temp->next;
-      current = (Room *)temp->data;
-   }
-   pthread_mutex_unlock(&mutex);
-   return current->ID;
+   if (temp == NULL) { return -1; }
+   return ((Room *)temp->data)->ID;
 }
 
 
 /* Return name of room node from ID */
-char *Rget_name(Node **head, int ID, pthread_mutex_t mutex) {
+char *Rget_name(Node **head, int ID, pthread_rwlock_t *lock) {
    char *error = "ERROR";
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
-   Room *current;
+   pthread_rwlock_rdlock(lock);
+   Node *temp = lookupRoomID(head, ID);
+   pthread_rwlock_unlock(lock);
 
-   //Cannot get name from empty list
-   if(*head == NULL) {
-      pthread_mutex_unlock(&mutex);
-      return error;
-   }
-   current = (Room *)temp->data;
-
-   //Search list for specified room
-   while(ID != current->ID) {
-      if(temp->next == NULL) {
-         pthread_mutex_unlock(&mutex);
-         return error;
-      }
-      temp=temp->next;
-      current = (Room *)temp->data;
-   }
-   pthread_mutex_unlock(&mutex);
-   return current->name;
+   if (temp == NULL) { return error; }
+   return ((Room *)temp->data)->name;
 }
 
 
-/* Print contents of room list */
-void RprintList(Node **head, pthread_mutex_t mutex) {
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
+/* Log contents of room list, only at debug level */
+void RprintList(Node **head, pthread_rwlock_t *lock) {
+   Node *temp;
    Room *current;
 
-   printf("Printing Room List\n");
+   if (!log_enabled(LEVEL_DEBUG)) { return; }
+   pthread_rwlock_rdlock(lock);
+   server_log(LEVEL_DEBUG, "Printing Room List");
    if(*head == NULL) {
-      printf("NULL\n");
-      pthread_mutex_unlock(&mutex);
-      return;
-   }
-   current = (Room *)temp->data;
-   printf("Room ID: %d, Room Name: %s,\n", current->ID, current->name);
-   printf("Contains Users...\n");
-   while(temp->next != NULL) {
-      temp = temp->next;
+      server_log(LEVEL_DEBUG, "NULL");
+   }
+   for (temp = *head; temp != NULL; temp = temp->next) {
       current = (Room *)temp->data;
-      printf("Room ID: %d, Room Name: %s,\n", current->ID, current->name);
-      printf("Contains Users...\n");
-      printList(&(current->user_list), current->user_list_mutex);
+      server_log(LEVEL_DEBUG, "Room ID: %d, Room Name: %s,", current->ID, current->name);
+      server_log(LEVEL_DEBUG, "Contains Users...");
+      printList(&(current->user_list), &current->user_list_lock);
    }
-   printf("End Room List\n");
-   pthread_mutex_unlock(&mutex);
+   server_log(LEVEL_DEBUG, "End Room List");
+   pthread_rwlock_unlock(lock);
 }
 
 
 /* REturns a room specified by ID */
-Room *Rget_roomFID(Node **head, int ID, pthread_mutex_t mutex) {
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
-   Room *current;
+Room *Rget_roomFID(Node **head, int ID, pthread_rwlock_t *lock) {
+   pthread_rwlock_rdlock(lock);
+   Node *temp = lookupRoomID(head, ID);
+   pthread_rwlock_unlock(lock);
 
-   if(*head == NULL) {
-      pthread_mutex_unlock(&mutex);
-      return NULL;
-   }
-   current = (Room *)temp->data;
-   while(ID != current->ID) {
-      if(temp->next == NULL) {
-         pthread_mutex_unlock(&mutex);
-         return NULL;
-      }
-      temp = temp->next;
-      current = (Room *)temp->data;
-   }
-   pthread_mutex_unlock(&mutex);
-   return current;
+   if (temp == NULL) { return NULL; }
+   return (Room *)temp->data;
 }
 
 
 /* Returns a room specified by name */
-Room *Rget_roomFNAME(Node **head, char *name, pthread_mutex_t mutex) {
-   pthread_mutex_lock(&mutex);
-   Node *temp = *head;
-   Room *current;
-
-   if(*head == NULL) {
-      pthread_mutex_unlock(&mutex);
-      return NULL;
-   }
-   current = (Room *)temp->data;
-   while(strcmp(name, current->name) != 0) {
-      if(temp->next == NULL) {
-         pthread_mutex_unlock(&mutex);
-         return NULL;
-      }
-      temp = temp->next;
-      current = (Room *)temp->data;
-   }
+Room *Rget_roomFNAME(Node **head, char *name, pthread_rwlock_t *lock) {
+   pthread_rwlock_rdlock(lock);
+   Node *temp = lookupRoomName(head, name);
+   pthread_rwlock_unlock(lock);
 
-   pthread_mutex_unlock(&mutex);
-   return current;
+   if (temp == NULL) { return NULL; }
+   return (Room *)temp->data;
 }
@@ -25,6 +25,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -32,6 +33,10 @@
 #define USERNAME_LENGTH 64
 #define REALNAME_LENGTH 64
 #define ROOMNAME_LENGTH 16
+#define MAX_USER_INDEXES 4      // user lists that can carry a hash index
+#define USER_INDEX_SIZE 1024    // initial slots of a user index, power of two
+#define MAX_ROOM_INDEXES 2      // room lists that can carry hash indexes
+#define ROOM_INDEX_SIZE 256     // initial slots of a room index, power of two
 
 /* Structures */
 struct user {
@@ -48,8 +53,15 @@ struct room {
    int ID;
    int fd;
    char name[ROOMNAME_LENGTH];
-   pthread_mutex_t user_list_mutex;
+   pthread_rwlock_t user_list_lock;
    struct node *user_list;
+   struct presence_batch *presence;   // changes waiting to be announced, see presence.c
+   pthread_mutex_t history_mutex;
+   struct out_msg **history;          // recent messages, oldest at history_head, see history.c
+   unsigned int history_head;
+   unsigned int history_count;
+   unsigned int history_seq;          // sequence number of the last room message
+   struct history_store *store;       // on disk history, see history_store.c
    struct room *next;
 };
 typedef struct room Room;
@@ -57,30 +69,59 @@ typedef struct room Room;
 struct node {
    void *data;
    struct node *next;
+   struct node *prev;
 };
 typedef struct node Node;
 
+// Open addressing (linear probing) index over the nodes of a user list
+struct user_slot {
+   unsigned int hash;      // cached so most probes never touch the User
+   Node *node;
+};
+
+struct user_index {
+   Node **head;            // list this index belongs to
+   Node *tail;
+   unsigned int size;      // number of slots, always a power of two
+   unsigned int count;
+   struct user_slot *slots;
+};
+typedef struct user_index UserIndex;
+
+// Open addressing indexes over the nodes of a room list, rooms are never removed
+struct room_index {
+   Node **head;            // list this index belongs to
+   Node *tail;
+   unsigned int size;      // slots in each table, always a power of two
+   unsigned int count;
+   Node **by_id;
+   Node **by_name;
+};
+typedef struct room_index RoomIndex;
+
 /* Function Prototypes */
-int insertNode(Node **head, Node *new_node, pthread_mutex_t mutex);
-int removeNode(Node **head, Node *new_node, pthread_mutex_t mutex);
+int insertNode(Node **head, Node *new_node, pthread_rwlock_t *lock);
+int removeNode(Node **head, Node *new_node, pthread_rwlock_t *lock);
 
 // user nodes
-int insertUser(Node  **head, User *new_user, pthread_mutex_t mutex);
-int removeUser(Node  **head, User *new_user, pthread_mutex_t mutex);
-char *get_real_name(Node  **head, char *user, pthread_mutex_t mutex);
-unsigned char *get_password(Node  **head, char *user, pthread_mutex_t mutex);
-void readUserFile(Node  **head, char *filename, pthread_mutex_t mutex);
-void writeUserFile(Node **head, char *filename, pthread_mutex_t mutex);
-void printList(Node **head, pthread_mutex_t mutex);
-User *get_user(Node **head, char *user, pthread_mutex_t mutex);
-int listLength(Node **head, pthread_mutex_t mutex);
+UserIndex *createUserIndex(Node **head);
+int insertUser(Node  **head, User *new_user, pthread_rwlock_t *lock);
+int removeUser(Node  **head, User *new_user, pthread_rwlock_t *lock);
+char *get_real_name(Node  **head, char *user, pthread_rwlock_t *lock);
+unsigned char *get_password(Node  **head, char *user, pthread_rwlock_t *lock);
+int readUserFile(Node  **head, char *filename, pthread_rwlock_t *lock);
+void printList(Node **head, pthread_rwlock_t *lock);
+User *get_user(Node **head, char *user, pthread_rwlock_t *lock);
+int listLength(Node **head, pthread_rwlock_t *lock);
 // room nodes
-int insertRoom(Node **head, Room *new_room, pthread_mutex_t mutex);
-int Rget_ID(Node **head, char *name, pthread_mutex_t mutex);
-char *Rget_name(Node **head, int ID, pthread_mutex_t mutex);
-void RprintList(Node  **head, pthread_mutex_t mutex);
-Room *Rget_roomFID(Node **head, int ID, pthread_mutex_t mutex);
-Room *Rget_roomFNAME(Node **head, char *name, pthread_mutex_t mutex);
-int createRoom(Node **head, int ID, char *name, pthread_mutex_t mutex);
+RoomIndex *createRoomIndex(Node **head);
+int insertRoom(Node **head, Room *new_room, pthread_rwlock_t *lock);
+int Rget_ID(Node **head, char *name, pthread_rwlock_t *lock);
+char *Rget_name(Node **head, int ID, pthread_rwlock_t *lock);
+void RprintList(Node  **head, pthread_rwlock_t *lock);
+Room *Rget_roomFID(Node **head, int ID, pthread_rwlock_t *lock);
+Room *Rget_roomFNAME(Node **head, char *name, pthread_rwlock_t *lock);
+int room_member(Room *room, char *user, int fd);
+int createRoom(Node **head, int ID, char *name, pthread_rwlock_t *lock);
 
 #endif
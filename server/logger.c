@@ -0,0 +1,201 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           logger.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+/*
+ *Server output goes through a single writer thread.  A caller formats its
+ *line on its own stack, copies it into the next slot of a ring and moves
+ *on, the writer hands every line waiting to stdout with one writev.  When
+ *the ring is full the line is counted and dropped rather than holding up
+ *the caller.  Until the writer starts, and once it stops, lines are
+ *written straight away.
+ */
+struct log_slot {
+   size_t len;
+   char text[LOG_TEXT];
+};
+
+int log_level = LEVEL_INFO;
+static char const *level_names[] = {"error", "warn", "info", "debug"};
+static struct log_slot ring[LOG_RING];
+static unsigned long ring_head = 0;     // next slot filled by a caller
+static unsigned long ring_tail = 0;     // next slot written by the writer
+static unsigned long ring_dropped = 0;  // lines lost to a full ring since last reported
+static int writer_running = 0;
+static int writer_idle = 0;
+static int writer_stopping = 0;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t writer_thread;
+
+
+/* Write lines to stdout, finishing any short write */
+static void write_lines(struct iovec *iov, int count) {
+   ssize_t n;
+
+   while (count > 0) {
+      n = writev(STDOUT_FILENO, iov, count);
+      if (n == -1 && errno == EINTR) { continue; }
+      if (n <= 0) { return; }
+      while (count > 0 && (size_t) n >= iov->iov_len) {
+         n -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if (count > 0) {
+         iov->iov_base = (char *)iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+}
+
+
+/* Write a single line to stdout */
+static void write_line(char *text, size_t len) {
+   struct iovec iov;
+
+   iov.iov_base = text;
+   iov.iov_len = len;
+   write_lines(&iov, 1);
+}
+
+
+/* Log writer thread */
+static void *logger_run(void *ptr) {
+   struct iovec iov[LOG_WRITE];
+   char notice[128];
+   unsigned long tail, head, dropped;
+   int count;
+
+   pthread_mutex_lock(&ring_mutex);
+   while (1) {
+      while (ring_head == ring_tail && ring_dropped == 0 && !writer_stopping) {
+         writer_idle = 1;
+         pthread_cond_wait(&ring_ready, &ring_mutex);
+         writer_idle = 0;
+      }
+      if (ring_head == ring_tail && ring_dropped == 0) {
+         // Drained and stopping, later lines are written by their callers
+         writer_running = 0;
+         break;
+      }
+      tail = ring_tail;
+      head = ring_head;
+      dropped = ring_dropped;
+      ring_dropped = 0;
+      pthread_mutex_unlock(&ring_mutex);
+
+      // Callers leave the slots from tail to head alone until tail moves past them
+      for (count = 0; count < LOG_WRITE && tail + count != head; count++) {
+         iov[count].iov_base = ring[(tail + count) % LOG_RING].text;
+         iov[count].iov_len = ring[(tail + count) % LOG_RING].len;
+      }
+      write_lines(iov, count);
+      if (dropped) {
+         write_line(notice, snprintf(notice, sizeof(notice), "%s --- Warning:%s %lu log lines dropped.\n", \
+                                     YELLOW, NORMAL, dropped));
+      }
+
+      pthread_mutex_lock(&ring_mutex);
+      ring_tail = tail + count;
+   }
+   pthread_mutex_unlock(&ring_mutex);
+   return NULL;
+}
+
+
+/* Log a line at the given level, use server_log so filtered lines cost nothing */
+void log_line(int level, const char *format, ...) {
+   char text[LOG_TEXT];
+   struct log_slot *slot;
+   va_list args;
+   size_t len = 0;
+   int n;
+
+   if (level == LEVEL_ERROR) {
+      len = snprintf(text, LOG_TEXT, "%s --- Error:%s ", RED, NORMAL);
+   }
+   else if (level == LEVEL_WARN) {
+      len = snprintf(text, LOG_TEXT, "%s --- Warning:%s ", YELLOW, NORMAL);
+   }
+   va_start(args, format);
+   n = vsnprintf(text + len, LOG_TEXT - len, format, args);
+   va_end(args);
+   if (n < 0) { return; }
+   len += n;
+   if (len > LOG_TEXT - 1) { len = LOG_TEXT - 1; }
+   text[len++] = '\n';
+
+   pthread_mutex_lock(&ring_mutex);
+   if (!writer_running) {
+      // Holding the mutex keeps direct lines whole and in order
+      write_line(text, len);
+   }
+   else if (ring_head - ring_tail == LOG_RING) {
+      ring_dropped++;
+   }
+   else {
+      slot = &ring[ring_head % LOG_RING];
+      memcpy(slot->text, text, len);
+      slot->len = len;
+      ring_head++;
+      if (writer_idle) { pthread_cond_signal(&ring_ready); }
+   }
+   pthread_mutex_unlock(&ring_mutex);
+}
+
+
+/* Level named error, warn, info or debug, -1 for anything else */
+int parse_log_level(char *name) {
+   int i;
+
+   for (i = 0; i <= LEVEL_DEBUG; i++) {
+      if (strcmp(name, level_names[i]) == 0) { return i; }
+   }
+   return -1;
+}
+
+
+/* Start the log writer */
+int start_logger() {
+   writer_running = 1;
+   if (pthread_create(&writer_thread, NULL, logger_run, NULL)) {
+      writer_running = 0;
+      server_log(LEVEL_ERROR, "Log writer thread not created.");
+      return -1;
+   }
+   return 0;
+}
+
+
+/* Write out every queued line and stop the writer */
+void stop_logger() {
+   pthread_mutex_lock(&ring_mutex);
+   if (!writer_running) {
+      pthread_mutex_unlock(&ring_mutex);
+      return;
+   }
+   writer_stopping = 1;
+   pthread_cond_signal(&ring_ready);
+   pthread_mutex_unlock(&ring_mutex);
+   pthread_join(writer_thread, NULL);
+}
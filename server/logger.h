@@ -0,0 +1,52 @@
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#ifndef LOGGER_H
+#define LOGGER_H
+
+/* System Header Files */
+#include <stdarg.h>
+
+/* Preprocessor Macros */
+// Log levels, lower is more severe
+#define LEVEL_ERROR 0
+#define LEVEL_WARN 1
+#define LEVEL_INFO 2
+#define LEVEL_DEBUG 3
+// Most verbose level compiled in, -DLOG_LEVEL_MAX=LEVEL_INFO leaves out every debug line
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LEVEL_DEBUG
+#endif
+#define LOG_RING 1024           // lines waiting for the log writer before more are dropped
+#define LOG_TEXT 2048           // longest line logged, longer ones are cut
+#define LOG_WRITE 64            // lines handed to one writev
+
+// True when a line at level would be logged, check it before building anything costly
+#define log_enabled(level) ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+// Log a printf style line, the arguments are not evaluated when the level is filtered out
+#define server_log(level, ...) do { if (log_enabled(level)) { log_line(level, __VA_ARGS__); } } while (0)
+
+/* Globals */
+extern int log_level;
+
+/* Function Prototypes */
+// logger.c
+void log_line(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int parse_log_level(char *name);
+int start_logger();
+void stop_logger();
+
+#endif
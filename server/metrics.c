@@ -0,0 +1,256 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           metrics.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+extern pthread_rwlock_t registered_users_lock;
+extern pthread_rwlock_t active_users_lock;
+extern Node *registered_users_list;
+extern Node *active_users_list;
+extern int numRooms;
+extern ThreadPool client_pool;
+extern ThreadPool hash_pool;
+extern unsigned long slow_dropped;
+extern unsigned long slow_coalesced;
+extern unsigned long slow_disconnects;
+extern unsigned long presence_changes;
+extern unsigned long presence_notices;
+
+/*
+ *Metrics registry.  Every thread that handles packets counts into a shard
+ *of its own, so recording a command is a few plain stores with no lock or
+ *shared cache line.  Shards are pushed onto a list once, when a thread
+ *first records something, and a dump adds them all up.  Command latencies
+ *go into log-linear histograms, METRICS_SUB buckets per power of two of
+ *microseconds, from which the dump reads its quantiles.  Gauges are read
+ *at dump time.  Dumps are text in the Prometheus exposition format, served
+ *to anyone connecting to the -a admin port on the loopback address.
+ */
+static MetricShard *shards = NULL;
+static __thread MetricShard *local_shard = NULL;
+static uint64_t started;
+static int admin_fd = -1;
+
+// Command names by option code, room messages come last
+static char *command_names[METRIC_COMMANDS] = {
+   "other", "register", "setpass", "setname", "login", "exit", "invite", "join", "getusers",
+   "getallusers", "getuser", "leave", "getmotd", "getrooms", "protocol", "gethistory", "search",
+   "resume", "message"
+};
+static char *counter_names[METRIC_COUNTERS] = {
+   "connections_accepted", "connections_turned_away", "errors_sent", "room_deliveries", "auth_refused"
+};
+
+
+/* Monotonic time in ns */
+uint64_t metrics_now() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* The calling thread's shard, made and registered on first use */
+static MetricShard *get_shard() {
+   MetricShard *shard = local_shard;
+
+   if (shard == NULL) {
+      shard = (MetricShard *)calloc(1, sizeof(MetricShard));
+      shard->next = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+      while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) { }
+      local_shard = shard;
+   }
+   return shard;
+}
+
+
+/* Only the owning thread writes a shard, the store just has to be whole for readers */
+static void bump(uint64_t *counter, uint64_t n) {
+   __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+
+/* Histogram bucket of a latency in us */
+static int latency_bucket(uint64_t us) {
+   int msb;
+
+   if (us < METRICS_SUB) { return (int) us; }
+   msb = 63 - __builtin_clzll(us);
+   if (msb >= METRICS_BUCKETS / METRICS_SUB) { return METRICS_BUCKETS - 1; }
+   return (msb - 1) * METRICS_SUB + (int) ((us >> (msb - 2)) & (METRICS_SUB - 1));
+}
+
+
+/* Smallest latency that falls in a bucket */
+static uint64_t bucket_value(int bucket) {
+   int msb;
+
+   if (bucket < METRICS_SUB) { return bucket; }
+   msb = bucket / METRICS_SUB + 1;
+   return ((uint64_t) (METRICS_SUB + bucket % METRICS_SUB)) << (msb - 2);
+}
+
+
+/* Record a handled packet, start is the metrics_now() it was picked up at */
+void count_command(int option, uint64_t start) {
+   MetricShard *shard = get_shard();
+   uint64_t us = (metrics_now() - start) / 1000;
+   int command;
+
+   if (option >= DEFAULT_ROOM) { command = METRIC_MESSAGE; }
+   else if (option > 0 && option < METRIC_MESSAGE) { command = option; }
+   else { command = 0; }
+   bump(&shard->calls[command], 1);
+   bump(&shard->total_us[command], us);
+   bump(&shard->latency[command][latency_bucket(us)], 1);
+}
+
+
+/* Add to one of the plain counters */
+void count_event(int counter, uint64_t n) {
+   bump(&get_shard()->counters[counter], n);
+}
+
+
+/* Latency below which a fraction q of the calls fell */
+static uint64_t quantile(uint64_t *hist, uint64_t calls, double q) {
+   uint64_t seen = 0;
+   int i;
+
+   for (i = 0; i < METRICS_BUCKETS; i++) {
+      seen += hist[i];
+      if (seen > 0 && seen >= q * calls) { return bucket_value(i); }
+   }
+   return bucket_value(METRICS_BUCKETS - 1);
+}
+
+
+/* Write every metric as text to a descriptor */
+void write_metrics(int fd) {
+   static double quantiles[] = { 0.5, 0.9, 0.99, 1.0 };
+   MetricShard *total = (MetricShard *)calloc(1, sizeof(MetricShard));
+   MetricShard *shard;
+   unsigned long queued_messages, queued_bytes;
+   int open_connections;
+   char *text = NULL;
+   size_t len = 0, done = 0;
+   ssize_t n;
+   FILE *out;
+   int i, j;
+
+   for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+      for (i = 0; i < METRIC_COMMANDS; i++) {
+         total->calls[i] += __atomic_load_n(&shard->calls[i], __ATOMIC_RELAXED);
+         total->total_us[i] += __atomic_load_n(&shard->total_us[i], __ATOMIC_RELAXED);
+         for (j = 0; j < METRICS_BUCKETS; j++) {
+            total->latency[i][j] += __atomic_load_n(&shard->latency[i][j], __ATOMIC_RELAXED);
+         }
+      }
+      for (i = 0; i < METRIC_COUNTERS; i++) {
+         total->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+      }
+   }
+   connection_stats(&open_connections, &queued_messages, &queued_bytes);
+
+   out = open_memstream(&text, &len);
+   fprintf(out, "tbdchat_uptime_seconds %.0f\n", (metrics_now() - started) / 1e9);
+   fprintf(out, "# TYPE tbdchat_command_latency_us summary\n");
+   for (i = 0; i < METRIC_COMMANDS; i++) {
+      if (total->calls[i] == 0) { continue; }
+      for (j = 0; j < (int) (sizeof(quantiles) / sizeof(quantiles[0])); j++) {
+         fprintf(out, "tbdchat_command_latency_us{command=\"%s\",quantile=\"%g\"} %llu\n", command_names[i],
+                 quantiles[j], (unsigned long long) quantile(total->latency[i], total->calls[i], quantiles[j]));
+      }
+      fprintf(out, "tbdchat_command_latency_us_sum{command=\"%s\"} %llu\n", command_names[i],
+              (unsigned long long) total->total_us[i]);
+      fprintf(out, "tbdchat_command_latency_us_count{command=\"%s\"} %llu\n", command_names[i],
+              (unsigned long long) total->calls[i]);
+   }
+   for (i = 0; i < METRIC_COUNTERS; i++) {
+      fprintf(out, "tbdchat_%s_total %llu\n", counter_names[i], (unsigned long long) total->counters[i]);
+   }
+   fprintf(out, "tbdchat_slow_dropped_total %lu\n", slow_dropped);
+   fprintf(out, "tbdchat_slow_coalesced_total %lu\n", slow_coalesced);
+   fprintf(out, "tbdchat_slow_disconnects_total %lu\n", slow_disconnects);
+   fprintf(out, "tbdchat_presence_changes_total %lu\n", presence_changes);
+   fprintf(out, "tbdchat_presence_notices_total %lu\n", presence_notices);
+   fprintf(out, "tbdchat_active_users %d\n", listLength(&active_users_list, &active_users_lock));
+   fprintf(out, "tbdchat_registered_users %d\n", listLength(&registered_users_list, &registered_users_lock));
+   fprintf(out, "tbdchat_rooms %d\n", numRooms - DEFAULT_ROOM);
+   fprintf(out, "tbdchat_open_connections %d\n", open_connections);
+   fprintf(out, "tbdchat_queued_messages %lu\n", queued_messages);
+   fprintf(out, "tbdchat_queued_bytes %lu\n", queued_bytes);
+   pthread_mutex_lock(&client_pool.mutex);
+   fprintf(out, "tbdchat_pool_threads %d\n", client_pool.size);
+   fprintf(out, "tbdchat_pool_idle %d\n", client_pool.idle);
+   fprintf(out, "tbdchat_pool_waiting %d\n", client_pool.count);
+   pthread_mutex_unlock(&client_pool.mutex);
+   pthread_mutex_lock(&hash_pool.mutex);
+   fprintf(out, "tbdchat_hash_pool_threads %d\n", hash_pool.size);
+   fprintf(out, "tbdchat_hash_pool_idle %d\n", hash_pool.idle);
+   fprintf(out, "tbdchat_hash_pool_waiting %d\n", hash_pool.count);
+   pthread_mutex_unlock(&hash_pool.mutex);
+   fclose(out);
+   free(total);
+
+   while (done < len) {
+      n = write(fd, text + done, len - done);
+      if (n == -1 && errno == EINTR) { continue; }
+      if (n <= 0) { break; }
+      done += n;
+   }
+   free(text);
+}
+
+
+/* Admin thread, hands a dump to whoever connects */
+static void *metrics_run(void *ptr) {
+   int fd;
+
+   while (1) {
+      if ((fd = accept_client(admin_fd, SOCK_CLOEXEC)) == -1) { continue; }
+      write_metrics(fd);
+      close(fd);
+   }
+   return NULL;
+}
+
+
+/* Start counting, and serve dumps on the loopback port given unless it is NULL */
+int start_metrics(char *port) {
+   pthread_t admin;
+
+   started = metrics_now();
+   if (port == NULL) { return 0; }
+   admin_fd = get_server_socket("127.0.0.1", port, 0);
+   if (admin_fd == -1 || start_server(admin_fd, METRICS_BACKLOG) == -1) {
+      server_log(LEVEL_ERROR, "Could not open admin port %s.", port);
+      return -1;
+   }
+   if (pthread_create(&admin, NULL, metrics_run, NULL)) {
+      server_log(LEVEL_ERROR, "Metrics thread not created.");
+      return -1;
+   }
+   pthread_detach(admin);
+   server_log(LEVEL_INFO, "Serving metrics on 127.0.0.1:%s", port);
+   return 0;
+}
@@ -0,0 +1,145 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           presence.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+extern pthread_rwlock_t rooms_lock;
+extern Node *room_list;
+
+/*
+ *Joins, leaves and disconnects are not broadcast as they happen.  Each room
+ *collects its changes for PRESENCE_MS after the first one and the members
+ *then get a single notice for all of them, so a crowd logging in at once
+ *costs one send per member instead of one per member for every login.  A
+ *lone change keeps its usual wording.
+ */
+static PresenceBatch *pending = NULL;
+static pthread_mutex_t presence_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t presence_cond = PTHREAD_COND_INITIALIZER;
+unsigned long presence_changes = 0;
+unsigned long presence_notices = 0;
+
+
+/* Send the notice for one room's batch of changes */
+static void send_batch(PresenceBatch *batch) {
+   packet ret;
+   int len;
+
+   memset(&ret, 0, sizeof(packet));
+   ret.options = batch->room->ID;
+   strcpy(ret.realname, SERVER_NAME);
+   strcpy(ret.username, SERVER_NAME);
+   ret.timestamp = time(NULL);
+   if (batch->joined + batch->left == 1) {
+      strcpy(ret.buf, batch->notice);
+   }
+   else {
+      // Name everyone while that fits a legacy packet, otherwise just count them
+      len = snprintf(ret.buf, BUFFERSIZE, "%d joined, %d left:%s", batch->joined, batch->left, batch->names);
+      if (batch->names_full || len >= BUFFERSIZE) {
+         snprintf(ret.buf, BUFFERSIZE, "%d joined, %d left.", batch->joined, batch->left);
+      }
+   }
+   send_message(&ret, -1);
+   __sync_add_and_fetch(&presence_notices, 1);
+}
+
+
+/* Presence thread, waits for a change and sends its room's notice PRESENCE_MS later */
+static void *presence_run(void *ptr) {
+   PresenceBatch *batch, *next;
+
+   while (1) {
+      pthread_mutex_lock(&presence_mutex);
+      while (pending == NULL) {
+         pthread_cond_wait(&presence_cond, &presence_mutex);
+      }
+      pthread_mutex_unlock(&presence_mutex);
+      usleep(PRESENCE_MS * 1000);
+
+      // Later changes start new batches while these are being sent
+      pthread_mutex_lock(&presence_mutex);
+      batch = pending;
+      pending = NULL;
+      for (next = batch; next != NULL; next = next->next) {
+         next->room->presence = NULL;
+      }
+      pthread_mutex_unlock(&presence_mutex);
+
+      while (batch != NULL) {
+         next = batch->next;
+         send_batch(batch);
+         free(batch);
+         batch = next;
+      }
+   }
+   return NULL;
+}
+
+
+/* Start the presence thread */
+int start_presence() {
+   pthread_t thread;
+
+   if (pthread_create(&thread, NULL, presence_run, NULL)) {
+      server_log(LEVEL_ERROR, "Presence thread not created.");
+      return -1;
+   }
+   pthread_detach(thread);
+   return 0;
+}
+
+
+/*
+ *Add a join (joined set) or leave of name to the next notice for the room
+ *in pkt->options.  pkt->buf is what gets sent if nobody else comes or goes
+ */
+void announce_presence(packet *pkt, char *name, int joined) {
+   Room *room = Rget_roomFID(&room_list, pkt->options, &rooms_lock);
+   PresenceBatch *batch;
+   size_t len = strlen(name);
+
+   if (room == NULL) { return; }
+   pthread_mutex_lock(&presence_mutex);
+   batch = room->presence;
+   if (batch == NULL) {
+      batch = (PresenceBatch *)calloc(1, sizeof(PresenceBatch));
+      batch->room = room;
+      strncpy(batch->notice, pkt->buf, BUFFERSIZE - 1);
+      batch->next = pending;
+      if (pending == NULL) { pthread_cond_signal(&presence_cond); }
+      pending = batch;
+      room->presence = batch;
+   }
+   if (joined) { batch->joined++; }
+   else { batch->left++; }
+   if (batch->names_len + len + 2 < sizeof(batch->names)) {
+      batch->names[batch->names_len++] = ' ';
+      batch->names[batch->names_len++] = joined ? '+' : '-';
+      memcpy(batch->names + batch->names_len, name, len + 1);
+      batch->names_len += len;
+   }
+   else {
+      batch->names_full = 1;
+   }
+   pthread_mutex_unlock(&presence_mutex);
+   __sync_add_and_fetch(&presence_changes, 1);
+}
@@ -0,0 +1,204 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           room_log.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+/*
+ *Room messages are logged by a single writer thread.  Senders push the
+ *shared OutMsg of a message onto a lock-free multiple producer, single
+ *consumer queue linked through the message itself, and the writer formats
+ *whatever has collected and writes each run of lines for a room with one
+ *writev, followed by the same run in binary to the room's history store.
+ *It wakes every LOG_FLUSH_MS or once LOG_BATCH lines are waiting.
+ */
+static OutMsg log_stub;
+static OutMsg *volatile log_head = &log_stub;   // producers push here
+static OutMsg *log_tail = &log_stub;            // writer pops from here
+static int log_pending = 0;                     // lines queued and not yet drained
+static int log_stopping = 0;
+static sem_t log_sem;
+static pthread_t log_thread;
+
+
+/* Link a message onto the queue, safe from any number of threads */
+static void log_push(OutMsg *msg) {
+   OutMsg *prev;
+
+   msg->log_next = NULL;
+   prev = __atomic_exchange_n(&log_head, msg, __ATOMIC_ACQ_REL);
+   __atomic_store_n(&prev->log_next, msg, __ATOMIC_RELEASE);
+}
+
+
+/* Take the oldest message off the queue, NULL if none is ready.  Writer only */
+static OutMsg *log_pop() {
+   OutMsg *tail = log_tail;
+   OutMsg *next = __atomic_load_n(&tail->log_next, __ATOMIC_ACQUIRE);
+
+   if (tail == &log_stub) {
+      if (next == NULL) { return NULL; }
+      log_tail = next;
+      tail = next;
+      next = __atomic_load_n(&next->log_next, __ATOMIC_ACQUIRE);
+   }
+   if (next != NULL) {
+      log_tail = next;
+      return tail;
+   }
+   // The last message can only be taken once the stub is queued behind it
+   if (tail != __atomic_load_n(&log_head, __ATOMIC_ACQUIRE)) { return NULL; }
+   log_push(&log_stub);
+   next = __atomic_load_n(&tail->log_next, __ATOMIC_ACQUIRE);
+   if (next != NULL) {
+      log_tail = next;
+      return tail;
+   }
+   return NULL;
+}
+
+
+/* Format the log line of a message into LOG_LINE bytes, returns its length */
+size_t format_log_line(OutMsg *msg, char *line) {
+   packet pkt;
+   struct tm tm;
+   size_t len;
+
+   // Rebuild the fields from the framed bytes shared with the member queues
+   if (decode_packet(PROTO_FRAMED, msg->data, msg->len, &pkt) <= 0) { return 0; }
+   asctime_r(localtime_r(&pkt.timestamp, &tm), line);
+   len = strlen(line) - 1;
+   len += snprintf(line + len, LOG_LINE - len, " | [%s] %s\n", pkt.realname, pkt.buf);
+   if (len >= LOG_LINE) { len = LOG_LINE - 1; }
+   return len;
+}
+
+
+/* Write a run of lines to one room log, finishing any short write */
+static void write_lines(int fd, struct iovec *iov, int count) {
+   ssize_t n;
+
+   while (count > 0) {
+      n = writev(fd, iov, count);
+      if (n == -1 && errno == EINTR) { continue; }
+      if (n <= 0) {
+         server_log(LEVEL_ERROR, "Could not write room log %d.", fd);
+         return;
+      }
+      while (count > 0 && (size_t) n >= iov->iov_len) {
+         n -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if (count > 0) {
+         iov->iov_base = (char *)iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+}
+
+
+/* Write out a run of messages of one room and let go of them */
+static void write_run(Room *room, struct iovec *iov, OutMsg **run, int count) {
+   int i;
+
+   write_lines(room->fd, iov, count);
+   append_history(room, run, count);
+   for (i = 0; i < count; i++) {
+      release_message(run[i]);
+   }
+}
+
+
+/* Log writer thread */
+static void *room_log_run(void *ptr) {
+   struct iovec iov[LOG_IOV];
+   OutMsg *run[LOG_IOV];
+   char *lines = (char *)malloc(LOG_IOV * LOG_LINE);
+   struct timespec deadline;
+   OutMsg *msg;
+   Room *room;
+   int count, drained;
+   int backlog = 0;
+
+   while (1) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      // A full batch that queued up during the last pass is written without waiting
+      if (backlog < LOG_BATCH) {
+         sem_timedwait(&log_sem, &deadline);
+      }
+
+      count = 0;
+      drained = 0;
+      room = NULL;
+      while ((msg = log_pop()) != NULL) {
+         drained++;
+         // Consecutive lines for the same room go out in one writev
+         if (count == LOG_IOV || (count && msg->log_room != room)) {
+            write_run(room, iov, run, count);
+            count = 0;
+         }
+         room = msg->log_room;
+         iov[count].iov_base = lines + count * LOG_LINE;
+         iov[count].iov_len = format_log_line(msg, lines + count * LOG_LINE);
+         if (iov[count].iov_len) { run[count++] = msg; }
+         else { release_message(msg); }
+      }
+      if (count) { write_run(room, iov, run, count); }
+      backlog = __sync_sub_and_fetch(&log_pending, drained);
+      if (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE) && log_tail == &log_stub && log_stub.log_next == NULL) { break; }
+   }
+   free(lines);
+   return NULL;
+}
+
+
+/* Start the room log writer */
+int start_room_log() {
+   sem_init(&log_sem, 0, 0);
+   if (pthread_create(&log_thread, NULL, room_log_run, NULL)) {
+      server_log(LEVEL_ERROR, "Room log thread not created.");
+      return -1;
+   }
+   return 0;
+}
+
+
+/* Write out every queued line and stop the writer */
+void stop_room_log() {
+   __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+   sem_post(&log_sem);
+   pthread_join(log_thread, NULL);
+}
+
+
+/* Queue a room message for the log of the room, the writer takes its own reference */
+void log_message(OutMsg *msg, Room *room) {
+   __sync_add_and_fetch(&msg->refs, 1);
+   msg->log_room = room;
+   log_push(msg);
+   // Wake the writer when the backlog reaches LOG_BATCH, it takes the count back down as it drains
+   if (__sync_add_and_fetch(&log_pending, 1) == LOG_BATCH) {
+      sem_post(&log_sem);
+   }
+}
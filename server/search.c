@@ -0,0 +1,194 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           search.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+/*
+ *Per room inverted index for /search.  Every term of a chat line maps to the
+ *ascending list of history sequence numbers it appears in.  Terms are runs
+ *of ASCII letters and digits, lower cased and cut to SEARCH_TERM bytes.
+ *The room log writer adds to the index as it stores each message, what a
+ *room stored before is indexed in the background when its history store is
+ *opened.  Searches only take the read lock.
+ */
+
+
+/* FNV-1a hash of a term */
+static unsigned int hash_term(char *term) {
+   unsigned int hash = 2166136261u;
+
+   while (*term) {
+      hash ^= (unsigned char) *term++;
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+
+/* Slot holding term, or the empty slot where it would go */
+static unsigned int probe_term(SearchIndex *index, char *term) {
+   unsigned int mask = index->size - 1;
+   unsigned int i = hash_term(term) & mask;
+
+   while (index->slots[i] != NULL && strcmp(index->slots[i]->term, term) != 0) {
+      i = (i + 1) & mask;
+   }
+   return i;
+}
+
+
+/* Find or add a term, doubling the table once it is half full.  Write lock held */
+static SearchTerm *get_term(SearchIndex *index, char *term) {
+   SearchTerm **old = index->slots;
+   unsigned int old_size = index->size;
+   unsigned int i;
+
+   i = probe_term(index, term);
+   if (index->slots[i] != NULL) { return index->slots[i]; }
+   if ((index->count + 1) * 2 > index->size) {
+      index->size = old_size * 2;
+      index->slots = (SearchTerm **)calloc(index->size, sizeof(SearchTerm *));
+      for (i = 0; i < old_size; i++) {
+         if (old[i] != NULL) { index->slots[probe_term(index, old[i]->term)] = old[i]; }
+      }
+      free(old);
+      i = probe_term(index, term);
+   }
+   index->slots[i] = (SearchTerm *)calloc(1, sizeof(SearchTerm));
+   index->slots[i]->term = strdup(term);
+   index->count++;
+   return index->slots[i];
+}
+
+
+/* Copy the next term of text, lower cased, returns its length (0 at the end) */
+static int next_term(char **text, char *term) {
+   char *p = *text;
+   int len = 0;
+
+   while (*p && !isalnum((unsigned char) *p)) { p++; }
+   while (*p && isalnum((unsigned char) *p)) {
+      if (len < SEARCH_TERM - 1) { term[len++] = tolower((unsigned char) *p); }
+      p++;
+   }
+   term[len] = '\0';
+   *text = p;
+   return len;
+}
+
+
+/* Set up an empty index */
+void init_search_index(SearchIndex *index) {
+   pthread_rwlock_init(&index->lock, NULL);
+   index->size = SEARCH_INDEX_SIZE;
+   index->count = 0;
+   index->last_seq = 0;
+   index->slots = (SearchTerm **)calloc(index->size, sizeof(SearchTerm *));
+}
+
+
+/* Index the text of a stored framed message, server notices are left out */
+void index_message(SearchIndex *index, uint32_t seq, char *data, size_t len) {
+   char term[SEARCH_TERM];
+   SearchTerm *entry;
+   packet pkt;
+   char *text;
+
+   if (decode_packet(PROTO_FRAMED, data, len, &pkt) <= 0 || strcmp(pkt.username, SERVER_NAME) == 0) { return; }
+   text = pkt.buf;
+   pthread_rwlock_wrlock(&index->lock);
+   // Postings stay ascending, a message met again while catching up is skipped
+   if (seq <= index->last_seq) {
+      pthread_rwlock_unlock(&index->lock);
+      return;
+   }
+   index->last_seq = seq;
+   while (*text) {
+      if (next_term(&text, term) < SEARCH_MIN_TERM) { continue; }
+      entry = get_term(index, term);
+      // A term repeated in one message is only listed once
+      if (entry->count && entry->postings[entry->count - 1] == seq) { continue; }
+      if (entry->count == entry->cap) {
+         entry->cap = entry->cap ? entry->cap * 2 : 4;
+         entry->postings = (uint32_t *)realloc(entry->postings, entry->cap * sizeof(uint32_t));
+      }
+      entry->postings[entry->count++] = seq;
+   }
+   pthread_rwlock_unlock(&index->lock);
+}
+
+
+/* Whether a sorted posting list holds seq */
+static int has_posting(SearchTerm *entry, uint32_t seq) {
+   int lo = 0, hi = (int) entry->count - 1, mid;
+
+   while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      if (entry->postings[mid] == seq) { return 1; }
+      if (entry->postings[mid] < seq) { lo = mid + 1; }
+      else { hi = mid - 1; }
+   }
+   return 0;
+}
+
+
+/*
+ *Find the messages holding every term of query.  The newest max of them
+ *are put in seqs oldest first, returns how many
+ */
+int search_index(SearchIndex *index, char *query, uint32_t *seqs, int max) {
+   SearchTerm *terms[SEARCH_MAX_TERMS];
+   SearchTerm *shortest = NULL;
+   char term[SEARCH_TERM];
+   char *text = query;
+   int num = 0, found = 0, i, j;
+   unsigned int slot;
+   uint32_t seq;
+
+   pthread_rwlock_rdlock(&index->lock);
+   while (*text && num < SEARCH_MAX_TERMS) {
+      if (next_term(&text, term) < SEARCH_MIN_TERM) { continue; }
+      slot = probe_term(index, term);
+      // A term nobody used means nothing matches
+      if (index->slots[slot] == NULL) {
+         pthread_rwlock_unlock(&index->lock);
+         return 0;
+      }
+      terms[num++] = index->slots[slot];
+      if (shortest == NULL || index->slots[slot]->count < shortest->count) { shortest = index->slots[slot]; }
+   }
+   // Walk the rarest term from the newest end, checking the others for each message
+   for (i = (shortest == NULL) ? -1 : (int) shortest->count - 1; i >= 0 && found < max; i--) {
+      seq = shortest->postings[i];
+      for (j = 0; j < num; j++) {
+         if (terms[j] != shortest && !has_posting(terms[j], seq)) { break; }
+      }
+      if (j == num) { seqs[found++] = seq; }
+   }
+   pthread_rwlock_unlock(&index->lock);
+
+   for (i = 0; i < found / 2; i++) {
+      seq = seqs[i];
+      seqs[i] = seqs[found - 1 - i];
+      seqs[found - 1 - i] = seq;
+   }
+   return found;
+}
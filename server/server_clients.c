@@ -22,114 +22,176 @@
 #include "chat_server.h"
 
 extern int numRooms;
-extern pthread_mutex_t registered_users_mutex;
-extern pthread_mutex_t active_users_mutex;
-extern pthread_mutex_t rooms_mutex;
+extern pthread_rwlock_t registered_users_lock;
+extern pthread_rwlock_t active_users_lock;
+extern pthread_rwlock_t rooms_lock;
 extern Node *registered_users_list;
 extern Node *active_users_list;
 extern Node *room_list;
 extern char *server_MOTD;
+extern EventLoop flush_loop;
 
+static int dispatch_packet(Connection *conn, packet *in_pkt);
 
 /*
  *Main thread for each client.  Receives all messages
- *and passes the data off to the correct function.  Receives
- *a pointer to the file descriptor for the socket the thread
- *should listen on
+ *and passes the data off to the correct function.  Runs on a
+ *worker of the client pool, ptr carries the file descriptor for
+ *the socket to listen on
  */
 void *client_receive(void *ptr) {
-   int client = *(int *) ptr;
-   int received;
-   int logged_in = 0;
-   packet in_pkt, *client_message_ptr = &in_pkt;
-
-   while (1) {
-      received = recv(client, &in_pkt, sizeof(packet), 0);
-      if (received) {
-         debugPacket(client_message_ptr);
-
-         // Responses to not logged in clients
-         if (!logged_in) {
-            if(in_pkt.options == REGISTER) {
-               logged_in = register_user(&in_pkt, client);
-            }
-            else if(in_pkt.options == LOGIN) {
-               logged_in = login(&in_pkt, client);
-            }
-            else if(in_pkt.options == EXIT) {
-               close(client);
-               return NULL;
-            }
-            else {
-               sendError("Not logged in.", client);
-            }
-         }
+   int client = (int)(intptr_t) ptr;
+   Connection *conn = open_connection(client);
+   char *scratch;
 
-         // Responses to logged in clients
-         else if (logged_in) {
-            // Handle option messages for logged in client
-            if (in_pkt.options < 1000) {
-               if(in_pkt.options == REGISTER) {
-                  sendError("You may not register while logged in.", client);
-               }
-               else if(in_pkt.options == SETPASS) {
-                  set_pass(&in_pkt, client);
-               }
-               else if(in_pkt.options == SETNAME) {
-                  set_name(&in_pkt, client);
-               }
-               else if(in_pkt.options == LOGIN) {
-                  sendError("Already logged in.", client);
-               }
-               else if(in_pkt.options == EXIT) {
-                  exit_client(&in_pkt, client);
-                  return NULL;
-               }
-               else if(in_pkt.options == INVITE) {
-                  invite(&in_pkt, client);
-               }
-               else if(in_pkt.options == JOIN) {
-                  join(&in_pkt, client);
-               }
-               else if(in_pkt.options == LEAVE) {
-                  leave(&in_pkt, client);
-               }
-               else if(in_pkt.options == GETALLUSERS) {
-                  get_active_users(client);
-               }
-               else if(in_pkt.options == GETUSERS) {
-                  get_room_users(&in_pkt, client);
-               }
-               else if(in_pkt.options == GETUSER) {
-                  user_lookup(&in_pkt, client);
-               }
-               else if(in_pkt.options == GETROOMS) {
-                  get_room_list(client);
-               }
-               else if(in_pkt.options == GETMOTD) {
-                  sendMOTD(client);
-               }
-               else if(in_pkt.options == 0) {
-                  printf("%s --- Error:%s Abrupt disconnect on logged in client.\n", RED, NORMAL);
-                  exit_client(&in_pkt, client);
-                  return NULL;
-               }
-               else {
-                  printf("%s --- Error:%s Unknown message received from client.\n", RED, NORMAL);
-	       }
-            }
-            // Handle conversation message for logged in client
-            else {
-               // Will be treated as a message packet, safe to santize entire buffer
-               sanitizeInput((void *)&in_pkt.buf, 0);
-               send_message(&in_pkt, client);
-            }
-         }
+   if (conn == NULL) {
+      close(client);
+      return NULL;
+   }
+   // Output this thread cannot send right away is left to the flush loop
+   conn->loop = &flush_loop;
+   scratch = (char *)malloc(READ_CHUNK);
+   while (receive_packets(conn, scratch, READ_CHUNK)) { }
+   free(scratch);
+   return NULL;
+}
 
-         memset(&in_pkt, 0, sizeof(packet));
+
+/*
+ *Pass a received packet off to the correct function.  Used by both the
+ *client threads and the event loops, returns 0 when the connection is done
+ */
+int process_packet(Connection *conn, packet *in_pkt) {
+   uint64_t start = metrics_now();
+   int option = in_pkt->options;
+   int ret = dispatch_packet(conn, in_pkt);
+
+   // A check handed to the hashing pool is counted there once it is done
+   if (!conn->auth_busy) { count_command(option, start); }
+   return ret;
+}
+
+
+/* Run the handler of a packet's option */
+static int dispatch_packet(Connection *conn, packet *in_pkt) {
+   int client = conn->fd;
+
+   debugPacket(in_pkt);
+
+   // Protocol negotiation is allowed in any state
+   if (in_pkt->options == PROTOCOL) {
+      negotiate_protocol(conn, in_pkt);
+      return 1;
+   }
+
+   // Responses to not logged in clients
+   if (!conn->logged_in) {
+      if(in_pkt->options == REGISTER || in_pkt->options == LOGIN) {
+         submit_auth(conn, in_pkt);
+      }
+      else if(in_pkt->options == RESUME) {
+         conn->logged_in = resume_session(conn, in_pkt);
+      }
+      else if(in_pkt->options == EXIT) {
+         return 0;
+      }
+      else {
+         sendError("Not logged in.", client);
       }
    }
-   return NULL;
+
+   // Responses to logged in clients
+   else if (conn->logged_in) {
+      // Handle option messages for logged in client
+      if (in_pkt->options < 1000) {
+         if(in_pkt->options == REGISTER) {
+            sendError("You may not register while logged in.", client);
+         }
+         else if(in_pkt->options == SETPASS) {
+            submit_auth(conn, in_pkt);
+         }
+         else if(in_pkt->options == SETNAME) {
+            set_name(in_pkt, client);
+         }
+         else if(in_pkt->options == LOGIN || in_pkt->options == RESUME) {
+            sendError("Already logged in.", client);
+         }
+         else if(in_pkt->options == EXIT) {
+            end_session(conn->session);
+            exit_client(in_pkt, client);
+            return 0;
+         }
+         else if(in_pkt->options == INVITE) {
+            invite(in_pkt, client);
+         }
+         else if(in_pkt->options == JOIN) {
+            join(in_pkt, client);
+         }
+         else if(in_pkt->options == LEAVE) {
+            leave(in_pkt, client);
+         }
+         else if(in_pkt->options == GETALLUSERS) {
+            get_active_users(client);
+         }
+         else if(in_pkt->options == GETUSERS) {
+            get_room_users(in_pkt, client);
+         }
+         else if(in_pkt->options == GETUSER) {
+            user_lookup(in_pkt, client);
+         }
+         else if(in_pkt->options == GETROOMS) {
+            get_room_list(client);
+         }
+         else if(in_pkt->options == GETMOTD) {
+            sendMOTD(client);
+         }
+         else if(in_pkt->options == GETHISTORY) {
+            send_history(conn, in_pkt);
+         }
+         else if(in_pkt->options == SEARCH) {
+            send_search(conn, in_pkt);
+         }
+         else {
+            server_log(LEVEL_ERROR, "Unknown message received from client.");
+         }
+      }
+      // Handle conversation message for logged in client
+      else {
+         Room *room = Rget_roomFID(&room_list, in_pkt->options, &rooms_lock);
+         // A line may only go out under the sender's own name, and only to a room they are in
+         if (strcmp(in_pkt->username, conn->username) != 0) {
+            sendError("Messages must name their sender.", client);
+         }
+         else if (room == NULL) {
+            sendError("No such room.", client);
+         }
+         else if (!room_member(room, conn->username, client)) {
+            sendError("You are not in that room.", client);
+         }
+         else {
+            // Will be treated as a message packet, safe to santize entire buffer
+            sanitizeInput((void *)&in_pkt->buf, 0);
+            send_message(in_pkt, client);
+         }
+      }
+   }
+   return 1;
+}
+
+
+/* Switch a client over to framed packets if it asks for them */
+void negotiate_protocol(Connection *conn, packet *in_pkt) {
+   packet ret;
+   int proto = atoi(in_pkt->buf);
+
+   memset(&ret, 0, sizeof(packet));
+   ret.options = PROTOCOL;
+   strcpy(ret.username, SERVER_NAME);
+   strcpy(ret.realname, SERVER_NAME);
+   ret.timestamp = time(NULL);
+   if (proto != PROTO_FRAMED) { proto = PROTO_LEGACY; }
+   sprintf(ret.buf, "%d", proto);
+   switch_protocol(conn, &ret, proto);
 }
 
 
@@ -141,7 +203,8 @@ void sendError(char *error, int clientfd) {
    strcpy(ret.username, SERVER_NAME);
    strcpy(ret.realname, SERVER_NAME);
    strcpy(ret.buf, error);
-   send(clientfd, &ret, sizeof(packet), MSG_NOSIGNAL);
+   send_packet(clientfd, &ret);
+   count_event(COUNT_ERRORS, 1);
 }
 
 
@@ -184,10 +247,12 @@ int register_user(packet *in_pkt, int fd) {
    char *args[16];
    char cpy[BUFFERSIZE];
    char *tmp = cpy;
-   strcpy(tmp, in_pkt->buf);
+   // Framed packets may carry more than a command buffer holds
+   strncpy(tmp, in_pkt->buf, sizeof(cpy) - 1);
+   cpy[sizeof(cpy) - 1] = '\0';
 
    args[i] = strsep(&tmp, " \t");
-   while ((i < sizeof(args) - 1) && (args[i] != '\0')) {
+   while ((i < sizeof(args) / sizeof(args[0]) - 1) && (args[i] != '\0')) {
        args[++i] = strsep(&tmp, " \t");
    }
    // Check there are enough arguements to safely inspect them
@@ -195,7 +260,7 @@ int register_user(packet *in_pkt, int fd) {
       // Ensure requested username is valid
       if (!validUsername(args[1], fd)) { return 0; }
       // Check if the requested username is unique
-      if(strcmp(get_real_name(&registered_users_list, args[1], registered_users_mutex), "ERROR") !=0 || \
+      if(strcmp(get_real_name(&registered_users_list, args[1], &registered_users_lock), "ERROR") !=0 || \
                               !(strcmp(SERVER_NAME, args[1])) || \
                               strcmp(args[2], args[3]) != 0) {
          sendError("Username unavailable.", fd);
@@ -209,16 +274,13 @@ int register_user(packet *in_pkt, int fd) {
       strcpy(user->username, args[1]);
       strcpy(user->real_name, args[1]);
       // Hash password
-      SHA256_CTX sha256;
-      SHA256_Init(&sha256);
-      SHA256_Update(&sha256, args[2], strlen(args[2]));
-      SHA256_Final(user->password, &sha256);
+      hashPassword(args[2], user->password);
       user->sock = fd;
       user->next = NULL;
 
-      // Insert user as registered user, write new user data to file
-      insertUser(&registered_users_list, user, registered_users_mutex);
-      writeUserFile(&registered_users_list, USERS_FILE, registered_users_mutex);
+      // Insert user as registered user, journal the new account
+      insertUser(&registered_users_list, user, &registered_users_lock);
+      journal_user(user);
 
       // Reform packet as valid login, pass new user data to login
       memset(&in_pkt->buf, 0, sizeof(in_pkt->buf));
@@ -227,8 +289,7 @@ int register_user(packet *in_pkt, int fd) {
    }
    // There were not enough arguements received to correctly read them
    else {
-      printf("%s --- %sError:%s Malformed reg packet received from %s on %d, ignoring.\n", \
-             WHITE, RED, NORMAL, args[1], fd);
+      server_log(LEVEL_ERROR, "Malformed reg packet received from %s on %d, ignoring.", args[1], fd);
    }
    return 0;
 }
@@ -243,65 +304,68 @@ int login(packet *pkt, int fd) {
    char cpy[BUFFERSIZE];
    char *tmp = cpy;
    unsigned char *arg_pass_hash = (unsigned char *)malloc(SHA256_DIGEST);
-   strcpy(tmp, pkt->buf);
+   // Framed packets may carry more than a command buffer holds
+   strncpy(tmp, pkt->buf, sizeof(cpy) - 1);
+   cpy[sizeof(cpy) - 1] = '\0';
 
    args[i] = strsep(&tmp, " \t");
-   while ((i < sizeof(args) - 1) && (args[i] != '\0')) {
+   while ((i < sizeof(args) / sizeof(args[0]) - 1) && (args[i] != '\0')) {
        args[++i] = strsep(&tmp, " \t");
    }
    // Check there are enough arguements to safely inspect them
    if (i > 2) {
       packet ret;
-      // Check if user exists as registered user
-      if (strcmp(get_real_name(&registered_users_list, args[1], registered_users_mutex), "ERROR") == 0) {
+      // Check if user exists as registered user, one index lookup serves the whole login
+      User *user = get_user(&registered_users_list, args[1], &registered_users_lock);
+      if (user == NULL) {
          sendError("Username not found.", fd);
+         free(arg_pass_hash);
          return 0;
       }
-      // Retreive password for requested user
-      unsigned char *password = get_password(&registered_users_list, args[1], registered_users_mutex);
       // Hash login password arg
-      SHA256_CTX sha256;
-      SHA256_Init(&sha256);
-      SHA256_Update(&sha256, args[2], strlen(args[2]));
-      SHA256_Final(arg_pass_hash, &sha256);
+      hashPassword(args[2], arg_pass_hash);
 
       // Compare pass arg and stored pass
-      if (comparePasswords(password, arg_pass_hash, 32) != 0) {
+      if (comparePasswords(user->password, arg_pass_hash, 32) != 0) {
          sendError("Incorrect password.", fd);
          free(arg_pass_hash);
          return 0;
       }
       free(arg_pass_hash);
 
-      // Login input is valid, read user data from registered users
-      User *user = get_user(&registered_users_list, args[1], registered_users_mutex);
-
-      //Create node for active users list
-      Node *new_usr_act = (Node *)malloc(sizeof(Node));
-      new_usr_act->data = (void *)user;
-      new_usr_act->next = NULL;
-
       //Create node for room list
       Node *new_usr_rm = (Node *)malloc(sizeof(Node));
       new_usr_rm->data = (void *)user;
       new_usr_rm->next = NULL;
 
       // Check if the user is already logged in
-      if(insertUser(&active_users_list, user, active_users_mutex) == 1) {
+      if(insertUser(&active_users_list, user, &active_users_lock) == 1) {
          user->sock = fd;
          user->roomID = 1000;
 
+         // Remember who is on this socket so a hang up can be cleaned up
+         Connection *conn = get_connection(fd);
+         if (conn != NULL) {
+            strcpy(conn->username, user->username);
+         }
+
          // Login successful, add user to default room
-         Room *defaultRoom = Rget_roomFID(&room_list, DEFAULT_ROOM, rooms_mutex);
-         insertNode(&(defaultRoom->user_list), new_usr_rm, defaultRoom->user_list_mutex);
+         Room *defaultRoom = Rget_roomFID(&room_list, DEFAULT_ROOM, &rooms_lock);
+         insertNode(&(defaultRoom->user_list), new_usr_rm, &defaultRoom->user_list_lock);
 
          // Inform client of successful login
-         strcpy(ret.realname, get_real_name(&registered_users_list, args[1], registered_users_mutex));
+         memset(&ret, 0, sizeof(packet));
+         strcpy(ret.realname, user->real_name);
          strcpy(ret.username, args[1]);
          ret.options = LOGSUC;
+         // The resume token rides along for clients that reconnect
+         if (conn != NULL) {
+            open_session(user, conn->session);
+            strcpy(ret.buf, conn->session);
+         }
          //printf("%s logged in\n", ret.username);
          ret.timestamp = time(NULL);
-         send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+         send_packet(fd, &ret);
 
          // Inform lobby of successful login
          memset(&ret, 0, sizeof(packet));
@@ -310,24 +374,24 @@ int login(packet *pkt, int fd) {
          strcpy(ret.username, SERVER_NAME);
          sprintf(ret.buf, "%s has joined the lobby.", user->real_name);
          ret.timestamp = time(NULL);
-         send_message(&ret, -1);
+         announce_presence(&ret, user->real_name, 1);
 
-         // Send MOTD to client
+         // Send MOTD to client, then what was said in the lobby lately
          sendMOTD(fd);
+         replay_history(defaultRoom, fd);
          return 1;
       }
       // Valid login data received, but user is already in active users
       else {
          sendError("User already logged in.", fd);
-         printf("%s log in failed: already logged in", args[1]);
-         free(user);
+         server_log(LEVEL_INFO, "%s log in failed: already logged in", args[1]);
+         free(new_usr_rm);
          return 0;
       }
    }
    // Not enough arguements received to properly parse input, ignore it
    else {
-      printf("%s --- %sError:%s Malformed login packet received from %s on %d, ignoring.\n", \
-             WHITE, RED, NORMAL, args[1], fd);
+      server_log(LEVEL_ERROR, "Malformed login packet received from %s on %d, ignoring.", args[1], fd);
    }
    return 0;
 }
@@ -343,14 +407,14 @@ void invite(packet *in_pkt, int fd) {
    packet ret;
 
    args[i] = strsep(&tmp, " \t");
-   while ((i < sizeof(args) - 1) && (args[i] != '\0')) {
+   while ((i < sizeof(args) / sizeof(args[0]) - 1) && (args[i] != '\0')) {
       args[++i] = strsep(&tmp, " \t");
    }
    if (i > 1) {
       roomNum = atoi(args[1]);
-      Room *currRoom = Rget_roomFID(&room_list, roomNum, rooms_mutex);
+      Room *currRoom = Rget_roomFID(&room_list, roomNum, &rooms_lock);
       if (currRoom != NULL) {
-         User *inviteUser = get_user(&active_users_list, args[0], active_users_mutex);
+         User *inviteUser = get_user(&active_users_list, args[0], &active_users_lock);
          if (inviteUser != NULL) {
             ret.options = INVITE;
             ret.timestamp = time(NULL);
@@ -358,30 +422,30 @@ void invite(packet *in_pkt, int fd) {
             strcpy(ret.realname, in_pkt->realname);
             memset(&ret.buf, 0, sizeof(ret.buf));
             sprintf(ret.buf, "%s has invited you to join %s", \
-                    in_pkt->realname, Rget_name(&room_list, roomNum, rooms_mutex));
-            send(inviteUser->sock, &ret, sizeof(packet), MSG_NOSIGNAL);
+                    in_pkt->realname, Rget_name(&room_list, roomNum, &rooms_lock));
+            send_packet(inviteUser->sock, &ret);
             memset(&ret, 0, sizeof(packet));
             ret.options = INVITESUC;
             strcpy(ret.username, SERVER_NAME);
             strcpy(ret.realname, SERVER_NAME);
             ret.timestamp = time(NULL);
-            send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+            send_packet(fd, &ret);
             return;
          }
       }
       else {
-         printf("%s --- Error:%s Trying to read user info but room is null.\n", RED, NORMAL);
+         server_log(LEVEL_ERROR, "Trying to read user info but room is null.");
       }
    }
    else {
-      printf("%s --- Error:%s Malformed buffer received, ignoring.\n", RED, NORMAL);
+      server_log(LEVEL_ERROR, "Malformed buffer received, ignoring.");
    }
    ret.options = SERV_ERR;
    strcpy(ret.username, SERVER_NAME);
    strcpy(ret.realname, SERVER_NAME);
    ret.timestamp = time(NULL);
    sprintf(ret.buf, "An invitation could not be sent to %s.", args[0]);
-   send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+   send_packet(fd, &ret);
 }
 
 
@@ -396,49 +460,56 @@ void join(packet *pkt, int fd) {
 
    // Split command args
    args[i] = strsep(&tmp, " \t");
-   while ((i < sizeof(args) - 1) && (args[i] != '\0')) {
+   while ((i < sizeof(args) / sizeof(args[0]) - 1) && (args[i] != '\0')) {
       args[++i] = strsep(&tmp, " \t");
    }
    if (i > 1 && validRoomname(args[0], fd)) {
       // check if room exists
-      printf("Checking if room exists . . .\n");
-      if (Rget_ID(&room_list, args[0], rooms_mutex) == -1) {
+      server_log(LEVEL_DEBUG, "Checking if room exists . . .");
+      if (Rget_ID(&room_list, args[0], &rooms_lock) == -1) {
          // create if it does not exist
-         createRoom(&room_list, numRooms, args[0], rooms_mutex);
+         createRoom(&room_list, __sync_fetch_and_add(&numRooms, 1), args[0], &rooms_lock);
       }
-      RprintList(&room_list, rooms_mutex);
-      printf("Receiving room node for requested room.\n");
-      Room *newRoom = Rget_roomFNAME(&room_list, args[0], rooms_mutex);
+      RprintList(&room_list, &rooms_lock);
+      server_log(LEVEL_DEBUG, "Receiving room node for requested room.");
+      Room *newRoom = Rget_roomFNAME(&room_list, args[0], &rooms_lock);
 
       int currRoomNum = atoi(args[1]);
       // Should check if current room exists
-      printf("Receiving room node for users current room.\n");
-      Room *currentRoom = Rget_roomFID(&room_list, currRoomNum, rooms_mutex);//pkt->options);
-      printf("Getting user node from current room user list.\n");
-      if(currentRoom == NULL) {
-         printf("Could not remove user: current room is NULL\n");
+      server_log(LEVEL_DEBUG, "Receiving room node for users current room.");
+      Room *currentRoom = Rget_roomFID(&room_list, currRoomNum, &rooms_lock);//pkt->options);
+      server_log(LEVEL_DEBUG, "Getting user node from current room user list.");
+      if(currentRoom == NULL || newRoom == NULL) {
+         server_log(LEVEL_WARN, "Could not move user: current or requested room is NULL");
       }
       else {
-         User *currUser = get_user(&(currentRoom->user_list), pkt->username, currentRoom->user_list_mutex);
-         printf("Removing user from his current rooms user list\n");
-         removeUser(&(currentRoom->user_list), currUser, currentRoom->user_list_mutex);
-         printf("User removed from current room\n");
+         User *currUser = get_user(&(currentRoom->user_list), pkt->username, &currentRoom->user_list_lock);
+         server_log(LEVEL_DEBUG, "Removing user from his current rooms user list");
+         removeUser(&(currentRoom->user_list), currUser, &currentRoom->user_list_lock);
+         server_log(LEVEL_DEBUG, "User removed from current room");
 
          //Create node to add user to other room list.
          Node *new_node = (Node *)malloc(sizeof(Node));
          new_node->data = currUser;
          currUser->roomID = newRoom->ID;
-         printf("Inserting user into new rooms user list\n");
-         insertUser(&(newRoom->user_list), currUser, newRoom->user_list_mutex);
+         server_log(LEVEL_DEBUG, "Inserting user into new rooms user list");
+         insertUser(&(newRoom->user_list), currUser, &newRoom->user_list_lock);
 
-         RprintList(&room_list, rooms_mutex);
+         RprintList(&room_list, &rooms_lock);
 
          ret.options = JOINSUC;
          strcpy(ret.realname, SERVER_NAME);
          strcpy(ret.username, SERVER_NAME);
          ret.timestamp = time(NULL);
          sprintf(ret.buf, "%s %d", args[0], newRoom->ID);
-         send(fd, (void *)&ret, sizeof(packet), MSG_NOSIGNAL);
+         send_packet(fd, &ret);
+         // A client coming back to a room may say what it has already seen
+         if (i > 2 && strtoul(args[2], NULL, 10) > 0) {
+            replay_since(newRoom, (uint32_t) strtoul(args[2], NULL, 10), fd);
+         }
+         else {
+            replay_history(newRoom, fd);
+         }
          memset(&ret, 0, sizeof(ret));
 
          ret.options = currRoomNum;
@@ -447,7 +518,7 @@ void join(packet *pkt, int fd) {
          strncpy(ret.buf, currUser->real_name, sizeof(currUser->real_name));
          strcat(ret.buf, " has left the room.");
          ret.timestamp = time(NULL);
-         send_message(&ret, -1);
+         announce_presence(&ret, currUser->real_name, 0);
          memset(&ret, 0, sizeof(ret));
 
          ret.options = newRoom->ID;
@@ -456,11 +527,11 @@ void join(packet *pkt, int fd) {
          strncpy(ret.buf, currUser->real_name, sizeof(currUser->real_name));
          strcat(ret.buf, " has joined the room.");
          ret.timestamp = time(NULL);
-         send_message(&ret, -1);
+         announce_presence(&ret, currUser->real_name, 1);
       }
    }
    else {
-      printf("Problem in join.\n");
+      server_log(LEVEL_DEBUG, "Problem in join.");
       sendError("We were unable to put you in that room, sorry.", fd);
    }
 }
@@ -475,7 +546,7 @@ void leave(packet *pkt, int fd) {
 
    // Split command args
    args[i] = strsep(&tmp, " \t");
-   while ((i < sizeof(args) - 1) && (args[i] != '\0')) {
+   while ((i < sizeof(args) / sizeof(args[0]) - 1) && (args[i] != '\0')) {
       args[++i] = strsep(&tmp, " \t");
    }
    if (i > 1) {
@@ -483,22 +554,22 @@ void leave(packet *pkt, int fd) {
       // If user is not in the lobby
       if (roomNum != DEFAULT_ROOM) {
          // Get current room information
-         Room *currRoom = Rget_roomFID(&room_list, roomNum, rooms_mutex);
+         Room *currRoom = Rget_roomFID(&room_list, roomNum, &rooms_lock);
          if (currRoom != NULL) {
             // Find users node in room
-            User *currUser = get_user(&(currRoom->user_list), pkt->username, currRoom->user_list_mutex);
+            User *currUser = get_user(&(currRoom->user_list), pkt->username, &currRoom->user_list_lock);
             if (currUser != NULL) {
                // Remove user from their current room
-               removeUser(&(currRoom->user_list), currUser, currRoom->user_list_mutex);
+               removeUser(&(currRoom->user_list), currUser, &currRoom->user_list_lock);
 
                //Create node to add user back to lobby
                Node *new_node = (Node *)malloc(sizeof(Node));
                new_node->data = currUser;
 
                // Place user in lobby room
-               Room *defaultRoom = Rget_roomFID(&room_list, DEFAULT_ROOM, rooms_mutex);
+               Room *defaultRoom = Rget_roomFID(&room_list, DEFAULT_ROOM, &rooms_lock);
                currUser->roomID = 1000;
-               insertUser(&(defaultRoom->user_list), currUser, defaultRoom->user_list_mutex);
+               insertUser(&(defaultRoom->user_list), currUser, &defaultRoom->user_list_lock);
 
                // Send user leave message to room
                ret.options = roomNum;
@@ -507,7 +578,7 @@ void leave(packet *pkt, int fd) {
                strncpy(ret.buf, currUser->real_name, sizeof(currUser->real_name));
                strcat(ret.buf, " has left the room.");
                ret.timestamp = time(NULL);
-               send_message(&ret, -1);
+               announce_presence(&ret, currUser->real_name, 0);
                memset(&ret, 0, sizeof(ret));
 
                // Send join success to client
@@ -517,7 +588,8 @@ void leave(packet *pkt, int fd) {
                sprintf(ret.buf, "%s %d", defaultRoom->name, defaultRoom->ID);
                strcat(ret.buf, " has joined the room.");
                ret.timestamp = time(NULL);
-               send(fd, (void *)&ret, sizeof(packet), MSG_NOSIGNAL);
+               send_packet(fd, &ret);
+               replay_history(defaultRoom, fd);
                memset(&ret, 0, sizeof(ret));
 
                // Send join notification to lobby room
@@ -527,7 +599,7 @@ void leave(packet *pkt, int fd) {
                strncpy(ret.buf, currUser->real_name, sizeof(currUser->real_name));
                strcat(ret.buf, " has joined the room.");
                ret.timestamp = time(NULL);
-               send_message(&ret, -1);
+               announce_presence(&ret, currUser->real_name, 1);
             }
          }
       }
@@ -542,18 +614,20 @@ void set_name(packet *pkt, int fd) {
    char name[64];
    packet ret;
 
-      strncpy(name, pkt->buf, sizeof(name));
-      name[strlen(pkt->buf)] = '\0';
+      strncpy(name, pkt->buf, sizeof(name) - 1);
+      name[sizeof(name) - 1] = '\0';
       if (!validRealname(name, fd)) { return; }
 
-      //Submit name change to user list, write list
-      User *user = get_user(&registered_users_list, pkt->username, registered_users_mutex);
+      //Submit name change to user list, journal it
+      User *user = get_user(&registered_users_list, pkt->username, &registered_users_lock);
 
       if(user != NULL) {
+         pthread_rwlock_wrlock(&registered_users_lock);
          strncpy(ret.buf, user->real_name, sizeof(user->real_name));
          memset(user->real_name, 0, sizeof(user->real_name));
          strncpy(user->real_name, name, sizeof(name));
-         writeUserFile(&registered_users_list, USERS_FILE, registered_users_mutex);
+         pthread_rwlock_unlock(&registered_users_lock);
+         journal_user(user);
 
          //printf("RIGHT BEFORE ATOI %s\n", args[i - 1]);
          ret.options = user->roomID;
@@ -570,7 +644,7 @@ void set_name(packet *pkt, int fd) {
          ret.options = NAMESUC;
       }
       else {
-         printf("%s --- Error:%s Trying to modify null user in user_list.\n", RED, NORMAL);
+         server_log(LEVEL_ERROR, "Trying to modify null user in user_list.");
          strcpy(ret.buf, "Name change failed, for some reason we couldn't find you.");
          ret.options = SERV_ERR;
       }
@@ -578,7 +652,7 @@ void set_name(packet *pkt, int fd) {
       strcpy(ret.realname, SERVER_NAME);
       strcpy(ret.username, SERVER_NAME);
       ret.timestamp = time(NULL);
-      send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+      send_packet(fd, &ret);
 }
 
 
@@ -591,10 +665,12 @@ void set_pass(packet *pkt, int fd) {
    char cpy[BUFFERSIZE];
    char *tmp = cpy;
    unsigned char *curr_pass_hash = (unsigned char *)malloc(SHA256_DIGEST);
-   strcpy(tmp, pkt->buf);
+   // Framed packets may carry more than a command buffer holds
+   strncpy(tmp, pkt->buf, sizeof(cpy) - 1);
+   cpy[sizeof(cpy) - 1] = '\0';
 
    args[i] = strsep(&tmp, " \t");
-   while ((i < sizeof(args) - 1) && (args[i] != '\0')) {
+   while ((i < sizeof(args) / sizeof(args[0]) - 1) && (args[i] != '\0')) {
        args[++i] = strsep(&tmp, " \t");
    }
    if (i > 3) {
@@ -602,23 +678,18 @@ void set_pass(packet *pkt, int fd) {
          free(curr_pass_hash);
          return;
       }
-      User *user = get_user(&registered_users_list, pkt->username, registered_users_mutex);
+      User *user = get_user(&registered_users_list, pkt->username, &registered_users_lock);
       if (user != NULL) {
          // Hash for pw compare
-         SHA256_CTX sha256;
-         SHA256_Init(&sha256);
-         SHA256_Update(&sha256, args[1], strlen(args[1]));
-         SHA256_Final(curr_pass_hash, &sha256);
+         hashPassword(args[1], curr_pass_hash);
          if (comparePasswords(user->password, curr_pass_hash, 32) == 0) {
-            memset(user->password, 0, 32);
-            // Hash new password
-            SHA256_CTX sha256;
-            SHA256_Init(&sha256);
-            SHA256_Update(&sha256, args[2], strlen(args[2]));
-            SHA256_Final(user->password, &sha256);
-            //pthread_mutex_lock(&registered_users_mutex);
-            writeUserFile(&registered_users_list, USERS_FILE, registered_users_mutex);
-            //pthread_mutex_unlock(&registered_users_mutex);
+            // Hash new password, then swap it in under the registry lock
+            hashPassword(args[2], curr_pass_hash);
+            pthread_rwlock_wrlock(&registered_users_lock);
+            memset(user->password, 0, sizeof(user->password));
+            memcpy(user->password, curr_pass_hash, 32);
+            pthread_rwlock_unlock(&registered_users_lock);
+            journal_user(user);
             pkt->options = PASSSUC;
          }
          else {
@@ -639,7 +710,7 @@ void set_pass(packet *pkt, int fd) {
    strcpy(pkt->username, SERVER_NAME);
    strcpy(pkt->realname, SERVER_NAME);
    pkt->timestamp = time(NULL);
-   send(fd, (void *)pkt, sizeof(packet), MSG_NOSIGNAL);
+   send_packet(fd, pkt);
 }
 
 
@@ -653,7 +724,7 @@ int validUsername (char *username, int client) {
       sendError("Username is too short.", client);
       return 0;
    }
-   if (strlen(username) > USERNAME_LENGTH) {
+   if (strlen(username) >= USERNAME_LENGTH) {
       sendError("Username is too long.", client);
       return 0;
    }
@@ -671,7 +742,7 @@ int validRealname (char *realname, int client) {
       sendError("Requested name is too short.", client);
       return 0;
    }
-   if (strlen(realname) > REALNAME_LENGTH) {
+   if (strlen(realname) >= REALNAME_LENGTH) {
       sendError("Requested name is too long.", client);
       return 0;
    }
@@ -708,7 +779,7 @@ int validRoomname (char *roomname, int client) {
       sendError("Requested room name is too short.", client);
       return 0;
    }
-   if (strlen(roomname) > ROOMNAME_LENGTH) {
+   if (strlen(roomname) >= ROOMNAME_LENGTH) {
       sendError("Requested room name is too long.", client);
       return 0;
    }
@@ -724,7 +795,7 @@ void exit_client(packet *pkt, int fd) {
    User *current;
 
    //Remove user from their current room and the active user's list
-   current = get_user(&active_users_list, pkt->username, active_users_mutex);
+   current = get_user(&active_users_list, pkt->username, &active_users_lock);
    if(current != NULL) {
       //Send disconnect message to user room
       ret.options = current->roomID;
@@ -732,7 +803,7 @@ void exit_client(packet *pkt, int fd) {
       strcpy(ret.username, SERVER_NAME);
       sprintf(ret.buf, "User %s has disconnected.", pkt->realname);
       ret.timestamp = time(NULL);
-      send_message(&ret, -1);
+      announce_presence(&ret, pkt->realname, 0);
 
       memset(&ret, 0, sizeof(packet));
       strcpy(ret.realname, SERVER_NAME);
@@ -740,16 +811,15 @@ void exit_client(packet *pkt, int fd) {
       ret.options = EXIT;
       strcat(ret.buf, "Goodbye!");
       ret.timestamp = time(NULL);
-      printf("Sending close message to %d\n", fd);
-      send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
-      close(fd);
-
-      Room *room = Rget_roomFID(&room_list, current->roomID, rooms_mutex);
-      printf("got room\n");
-      removeUser(&(room->user_list), current, room->user_list_mutex);
-      printf("removed user from current room\n");
-      removeUser(&active_users_list, current, active_users_mutex);
-      printf("removed user from active users\n");
+      server_log(LEVEL_DEBUG, "Sending close message to %d", fd);
+      send_packet(fd, &ret);
+
+      Room *room = Rget_roomFID(&room_list, current->roomID, &rooms_lock);
+      server_log(LEVEL_DEBUG, "got room");
+      removeUser(&(room->user_list), current, &room->user_list_lock);
+      server_log(LEVEL_DEBUG, "removed user from current room");
+      removeUser(&active_users_list, current, &active_users_lock);
+      server_log(LEVEL_DEBUG, "removed user from active users");
    }
 }
 
@@ -758,31 +828,46 @@ void exit_client(packet *pkt, int fd) {
  *Send Message
  */
 void send_message(packet *pkt, int clientfd) {
-   Room *currentRoom = Rget_roomFID(&room_list, pkt->options, rooms_mutex);
-   log_message(pkt, currentRoom->fd);
-   printList(&(currentRoom->user_list), currentRoom->user_list_mutex);
-   Node *tmp = currentRoom->user_list;
+   Room *currentRoom = Rget_roomFID(&room_list, pkt->options, &rooms_lock);
+   OutMsg *cache[PROTO_COUNT] = { NULL };
+   int i;
+   if (currentRoom == NULL) {
+      if (clientfd >= 0) { sendError("No such room.", clientfd); }
+      return;
+   }
+   // The message is serialized once per protocol, the framed copy is numbered and also feeds the room log writer
+   cache[PROTO_FRAMED] = stamp_message(currentRoom, pkt);
+   printList(&(currentRoom->user_list), &currentRoom->user_list_lock);
+   Node *tmp;
    User *current;
-   while(tmp != NULL) {
+   uint64_t sent = 0;
+   // Members only get a reference to the message queued, nobody waits on a slow reader
+   pthread_rwlock_rdlock(&currentRoom->user_list_lock);
+   for (tmp = currentRoom->user_list; tmp != NULL; tmp = tmp->next) {
       current = (User *)tmp->data;
       if (clientfd != current->sock) {
-         send(current->sock, (void *)pkt, sizeof(packet), MSG_NOSIGNAL);
+         send_shared(current->sock, pkt, cache);
+         sent++;
       }
-      tmp = tmp->next;
    }
-   // extra unlock????
-   pthread_mutex_unlock(&currentRoom->user_list_mutex);
+   pthread_rwlock_unlock(&currentRoom->user_list_lock);
+   count_event(COUNT_DELIVERIES, sent);
+   for (i = 0; i < PROTO_COUNT; i++) {
+      if (cache[i] != NULL) { release_message(cache[i]); }
+   }
 }
 
 
 /* Send the server MOTD to the socket passed in */
 void sendMOTD(int fd) {
    packet ret;
+   memset(&ret, 0, sizeof(packet));
+   strcpy(ret.username, SERVER_NAME);
    strcpy(ret.realname, SERVER_NAME);
    ret.options = MOTD;
    strcpy(ret.buf, server_MOTD);
    ret.timestamp = time(NULL);
-   send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+   send_packet(fd, &ret);
 }
 
 
@@ -796,24 +881,24 @@ void get_active_users(int fd) {
    strcpy(ret.username, SERVER_NAME);
    strcpy(ret.realname, SERVER_NAME);
 
-   int num_users = listLength(&active_users_list, active_users_mutex);
+   int num_users = listLength(&active_users_list, &active_users_lock);
    sprintf(ret.buf, "%d users online", num_users);
    ret.timestamp = time(NULL);
-   send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+   send_packet(fd, &ret);
    memset(&ret.buf, 0, sizeof(ret.buf));
 
-   pthread_mutex_lock(&active_users_mutex);
+   pthread_rwlock_rdlock(&active_users_lock);
    Node *temp = active_users_list;
    User *current;
    while(temp != NULL ) {
       current = (User *) temp->data;
       ret.timestamp = time(NULL);
       sprintf(ret.buf, "%s-%s", current->username, current->real_name);
-      send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+      send_packet(fd, &ret);
       memset(&ret.buf, 0, sizeof(ret.buf));
       temp = temp->next;
    }
-   pthread_mutex_unlock(&active_users_mutex);
+   pthread_rwlock_unlock(&active_users_lock);
 }
 
 
@@ -826,7 +911,7 @@ void user_lookup(packet *in_pkt, int fd) {
    char *tmp = in_pkt->buf;
 
    args[i] = strsep(&tmp, " \t");
-   while ((i < sizeof(args) - 1) && (args[i] != '\0')) {
+   while ((i < sizeof(args) / sizeof(args[0]) - 1) && (args[i] != '\0')) {
       args[++i] = strsep(&tmp, " \t");
    }
    if (i > 1) {
@@ -834,26 +919,26 @@ void user_lookup(packet *in_pkt, int fd) {
       ret.options = GETUSER;
       strcpy(ret.username, SERVER_NAME);
       strcpy(ret.realname, SERVER_NAME);
-      char *realname = get_real_name(&active_users_list, args[1], active_users_mutex);
+      char *realname = get_real_name(&active_users_list, args[1], &active_users_lock);
       if (strcmp(realname, "ERROR") == 0) {
          ret.options = SERV_ERR;
          sprintf(ret.buf, "%s not found.", args[1]);
          ret.timestamp = time(NULL);
-         send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+         send_packet(fd, &ret);
       }
       else {
          sprintf(ret.buf, "User Lookup");
          ret.timestamp = time(NULL);
-         send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+         send_packet(fd, &ret);
          memset(&ret.buf, 0, sizeof(ret.buf));
 
          strcpy(ret.buf, realname);
          sprintf(ret.buf, "%s-%s", args[1], realname);
-         send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+         send_packet(fd, &ret);
       }
    }
    else {
-      printf("%s --- Error:%s Malformed buffer received, ignoring.\n", RED, NORMAL);
+      server_log(LEVEL_ERROR, "Malformed buffer received, ignoring.");
    }
 }
 
@@ -862,12 +947,12 @@ void user_lookup(packet *in_pkt, int fd) {
  *Get users from specific room
  */
 void get_room_users(packet *in_pkt, int fd) {
-   User *user = get_user(&active_users_list, in_pkt->username, active_users_mutex);
+   User *user = get_user(&active_users_list, in_pkt->username, &active_users_lock);
    if(user != NULL) {
-      Room *currRoom = Rget_roomFID(&room_list, user->roomID, rooms_mutex);
+      Room *currRoom = Rget_roomFID(&room_list, user->roomID, &rooms_lock);
       if (currRoom != NULL) {
          packet ret;
-         int num_users = listLength(&currRoom->user_list, currRoom->user_list_mutex);
+         int num_users = listLength(&currRoom->user_list, &currRoom->user_list_lock);
 
          ret.options = GETUSERS;
          strcpy(ret.username, SERVER_NAME);
@@ -875,24 +960,24 @@ void get_room_users(packet *in_pkt, int fd) {
 
          sprintf(ret.buf, "%d users in %s", num_users, currRoom->name);
          ret.timestamp = time(NULL);
-         send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+         send_packet(fd, &ret);
          memset(&ret.buf, 0, sizeof(ret.buf));
 
-         pthread_mutex_lock(&currRoom->user_list_mutex);
+         pthread_rwlock_rdlock(&currRoom->user_list_lock);
          Node *temp = currRoom->user_list;
          User *current;
          while(temp != NULL ) {
             current = (User *)temp->data;
             ret.timestamp = time(NULL);
             sprintf(ret.buf, "%s-%s", current->username, current->real_name);
-            send(fd, &ret, sizeof(packet), MSG_NOSIGNAL);
+            send_packet(fd, &ret);
             memset(&ret.buf, 0, sizeof(ret.buf));
             temp = temp->next;
          }
-         pthread_mutex_unlock(&currRoom->user_list_mutex);
+         pthread_rwlock_unlock(&currRoom->user_list_lock);
       }
       else {
-         printf("%s --- Error:%s Trying to read user info but room is null.\n", RED, NORMAL);
+         server_log(LEVEL_ERROR, "Trying to read user info but room is null.");
       }
    }
 }
@@ -908,23 +993,29 @@ void get_room_list(int fd) {
    strcpy(pkt.username, SERVER_NAME);
    strcpy(pkt.realname, SERVER_NAME);
    pkt.timestamp = time(NULL);
-   int num_rooms = listLength(&room_list, rooms_mutex);
+   int num_rooms = listLength(&room_list, &rooms_lock);
    sprintf(pkt.buf, "%d Rooms Found", num_rooms);
-   send(fd, &pkt, sizeof(pkt), MSG_NOSIGNAL);
+   send_packet(fd, &pkt);
    memset(&pkt.buf, 0, sizeof(pkt.buf));
 
-   pthread_mutex_lock(&rooms_mutex);
+   pthread_rwlock_rdlock(&rooms_lock);
    Node  *temp = room_list;
    Room *current;
    while(temp != NULL ) {
       current = (Room *)temp->data;
       pkt.timestamp = time(NULL);
       strcpy(pkt.buf, current->name);
-      send(fd, &pkt, sizeof(pkt), MSG_NOSIGNAL);
+      send_packet(fd, &pkt);
       memset(&pkt.buf, 0, sizeof(pkt.buf));
       temp = temp->next;
    }
-   pthread_mutex_unlock(&rooms_mutex);
+   pthread_rwlock_unlock(&rooms_lock);
+}
+
+
+/* Hash a password into the first SHA256_DIGEST_LENGTH bytes of hash, as stored for each user */
+void hashPassword(char *password, unsigned char *hash) {
+   SHA256((unsigned char *)password, strlen(password), hash);
 }
 
 
@@ -942,21 +1033,3 @@ int comparePasswords(unsigned char *pass1, unsigned char *pass2, int size) {
    //printf("-----------------------------------------------------------\n\n");
    return 0;
 }
-
-
-/*
- *Logs the given message packet to the given fd
- */
-void log_message(packet *pkt, int fd) {
-   char *temp = (char*)malloc(256 * sizeof(char));
-   strcpy(temp, asctime(localtime(&(pkt->timestamp))));
-   temp[strlen(temp) - 1] = ' ';
-   strncat(temp, "| [", 3);
-   strncat(temp, pkt->realname, strlen(pkt->realname));
-   strncat(temp, "] ", 2);
-   strncat(temp, pkt->buf, strlen(pkt->buf));
-   strncat(temp, "\n", 2);
-   write(fd, temp, strlen(temp) * sizeof(char));
-}
-
-
@@ -0,0 +1,214 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           session.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+extern pthread_rwlock_t registered_users_lock;
+extern pthread_rwlock_t active_users_lock;
+extern pthread_rwlock_t rooms_lock;
+extern Node *registered_users_list;
+extern Node *active_users_list;
+extern Node *room_list;
+
+/*
+ *Resume tokens.  A login hands the client a random token with its LOGSUC.
+ *When the connection drops without an EXIT the session is parked for
+ *SESSION_TTL seconds with the room the user was in, and a client that comes
+ *back with RESUME and the token is put straight back there and sent what
+ *the room said meanwhile.  The token stays the same across resumes, and
+ *taking it back needs neither a password hash nor a scan of the users.
+ */
+static Session *sessions[SESSION_BUCKETS];
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Bucket of a token */
+static unsigned int session_bucket(char *token) {
+   unsigned int hash = 2166136261u;
+
+   while (*token) {
+      hash ^= (unsigned char) *token++;
+      hash *= 16777619u;
+   }
+   return hash % SESSION_BUCKETS;
+}
+
+
+/* Find a session and unlink expired ones on the way, sessions_mutex held */
+static Session *find_session(char *token) {
+   Session **link = &sessions[session_bucket(token)];
+   Session *session;
+   time_t now = time(NULL);
+
+   while ((session = *link) != NULL) {
+      if (session->expires && session->expires < now) {
+         *link = session->next;
+         free(session);
+         continue;
+      }
+      if (strcmp(session->token, token) == 0) { return session; }
+      link = &session->next;
+   }
+   return NULL;
+}
+
+
+/* Start a session for a user who just logged in, its token is copied to token */
+void open_session(User *user, char *token) {
+   unsigned char bytes[SESSION_TOKEN / 2];
+   Session *session;
+   unsigned int bucket;
+   int i;
+
+   if (RAND_bytes(bytes, sizeof(bytes)) != 1) {
+      token[0] = '\0';
+      return;
+   }
+   session = (Session *)calloc(1, sizeof(Session));
+   for (i = 0; i < (int) sizeof(bytes); i++) {
+      sprintf(session->token + 2 * i, "%02x", bytes[i]);
+   }
+   strncpy(session->username, user->username, sizeof(session->username) - 1);
+   session->roomID = DEFAULT_ROOM;
+   strcpy(token, session->token);
+
+   pthread_mutex_lock(&sessions_mutex);
+   bucket = session_bucket(session->token);
+   find_session(session->token);
+   session->next = sessions[bucket];
+   sessions[bucket] = session;
+   pthread_mutex_unlock(&sessions_mutex);
+}
+
+
+/* Keep a dropped client's session around for a while, remembering its room */
+void park_session(char *token, int roomID) {
+   Session *session;
+   Room *room;
+
+   if (token[0] == '\0') { return; }
+   room = Rget_roomFID(&room_list, roomID, &rooms_lock);
+   pthread_mutex_lock(&sessions_mutex);
+   if ((session = find_session(token)) != NULL) {
+      session->roomID = roomID;
+      session->seq = room != NULL ? history_position(room) : 0;
+      session->expires = time(NULL) + SESSION_TTL;
+   }
+   pthread_mutex_unlock(&sessions_mutex);
+}
+
+
+/* Forget a session, the client said goodbye */
+void end_session(char *token) {
+   Session **link;
+   Session *session;
+
+   if (token[0] == '\0') { return; }
+   pthread_mutex_lock(&sessions_mutex);
+   if ((session = find_session(token)) != NULL) {
+      // Expired ones may have been unlinked ahead of it, search the chain again
+      for (link = &sessions[session_bucket(token)]; *link != session; link = &(*link)->next) { }
+      *link = session->next;
+      free(session);
+   }
+   pthread_mutex_unlock(&sessions_mutex);
+}
+
+
+/*
+ *Handle RESUME, "token [seq]" with seq the last message the client has of
+ *its room.  Puts the user back in their room and returns 1, or tells the
+ *client to log in again and returns 0
+ */
+int resume_session(Connection *conn, packet *pkt) {
+   Session *session;
+   char username[USERNAME_LENGTH];
+   int roomID;
+   char token[SESSION_TOKEN + 1] = "";
+   uint32_t seq = 0;
+   User *user;
+   Room *room;
+   Node *node;
+   packet ret;
+
+   // A client that tracks sequence numbers knows best what it has seen
+   sscanf(pkt->buf, "%32s %u", token, &seq);
+   pthread_mutex_lock(&sessions_mutex);
+   session = find_session(token);
+   if (session == NULL || session->expires == 0) {
+      pthread_mutex_unlock(&sessions_mutex);
+      sendError("Session expired, please log in.", conn->fd);
+      return 0;
+   }
+   strcpy(username, session->username);
+   roomID = session->roomID;
+   if (seq == 0) { seq = session->seq; }
+   session->expires = 0;
+   pthread_mutex_unlock(&sessions_mutex);
+
+   user = get_user(&registered_users_list, username, &registered_users_lock);
+   if (user == NULL || insertUser(&active_users_list, user, &active_users_lock) != 1) {
+      park_session(token, roomID);
+      sendError("User already logged in.", conn->fd);
+      return 0;
+   }
+   if ((room = Rget_roomFID(&room_list, roomID, &rooms_lock)) == NULL) {
+      room = Rget_roomFID(&room_list, DEFAULT_ROOM, &rooms_lock);
+      seq = history_position(room);
+   }
+   user->sock = conn->fd;
+   user->roomID = room->ID;
+   node = (Node *)malloc(sizeof(Node));
+   node->data = (void *)user;
+   node->next = NULL;
+   insertNode(&room->user_list, node, &room->user_list_lock);
+   strcpy(conn->username, user->username);
+   strcpy(conn->session, token);
+
+   // Same replies as a login followed by a join, so clients need nothing new
+   memset(&ret, 0, sizeof(packet));
+   strcpy(ret.realname, user->real_name);
+   strcpy(ret.username, user->username);
+   strcpy(ret.buf, conn->session);
+   ret.options = LOGSUC;
+   ret.timestamp = time(NULL);
+   send_packet(conn->fd, &ret);
+   if (room->ID != DEFAULT_ROOM) {
+      memset(&ret, 0, sizeof(packet));
+      strcpy(ret.realname, SERVER_NAME);
+      strcpy(ret.username, SERVER_NAME);
+      sprintf(ret.buf, "%s %d", room->name, room->ID);
+      ret.options = JOINSUC;
+      ret.timestamp = time(NULL);
+      send_packet(conn->fd, &ret);
+   }
+
+   memset(&ret, 0, sizeof(packet));
+   ret.options = room->ID;
+   strcpy(ret.realname, SERVER_NAME);
+   strcpy(ret.username, SERVER_NAME);
+   sprintf(ret.buf, "%s has rejoined %s.", user->real_name, room->name);
+   ret.timestamp = time(NULL);
+   announce_presence(&ret, user->real_name, 1);
+
+   replay_since(room, seq, conn->fd);
+   return 1;
+}
@@ -0,0 +1,103 @@
+/*
+//   Program:             TBD Chat Server
+//   File Name:           thread_pool.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "chat_server.h"
+
+/*
+ *A fixed set of worker threads fed from a bounded ring of tasks.  Submitting
+ *never blocks and never creates a thread, a full queue is reported back to
+ *the caller so it can turn the work away.
+ */
+
+
+/* Worker thread, runs tasks in the order they were queued */
+static void *thread_pool_run(void *ptr) {
+   ThreadPool *pool = (ThreadPool *)ptr;
+   PoolTask task;
+
+   while (1) {
+      pthread_mutex_lock(&pool->mutex);
+      while (pool->count == 0) {
+         pthread_cond_wait(&pool->ready, &pool->mutex);
+      }
+      task = pool->tasks[pool->head];
+      pool->head = (pool->head + 1) % pool->cap;
+      pool->count--;
+      pool->idle--;
+      pthread_mutex_unlock(&pool->mutex);
+
+      task.run(task.arg);
+
+      pthread_mutex_lock(&pool->mutex);
+      pool->idle++;
+      pthread_mutex_unlock(&pool->mutex);
+   }
+   return NULL;
+}
+
+
+/* Start threads workers sharing a queue of up to queue waiting tasks */
+int create_thread_pool(ThreadPool *pool, int threads, int queue) {
+   pthread_t thread;
+   int i;
+
+   // Room for a task per idle worker on top of the ones left waiting
+   pool->tasks = (PoolTask *)calloc(threads + queue, sizeof(PoolTask));
+   pool->cap = threads + queue;
+   pool->queue = queue;
+   pool->head = 0;
+   pool->count = 0;
+   pool->idle = 0;
+   pool->size = 0;
+   pthread_mutex_init(&pool->mutex, NULL);
+   pthread_cond_init(&pool->ready, NULL);
+   for (i = 0; i < threads; i++) {
+      if (pthread_create(&thread, NULL, thread_pool_run, (void *)pool)) {
+         server_log(LEVEL_ERROR, "Worker thread %d of %d not created.", i + 1, threads);
+         return -1;
+      }
+      pthread_detach(thread);
+      pthread_mutex_lock(&pool->mutex);
+      pool->size++;
+      pool->idle++;
+      pthread_mutex_unlock(&pool->mutex);
+   }
+   return 0;
+}
+
+
+/*
+ *Queue a task for the next free worker.  Returns -1 without queueing when
+ *every worker is busy and queue tasks are already waiting
+ */
+int thread_pool_submit(ThreadPool *pool, void *(*run)(void *), void *arg) {
+   pthread_mutex_lock(&pool->mutex);
+   if (pool->count >= pool->idle + pool->queue) {
+      pthread_mutex_unlock(&pool->mutex);
+      return -1;
+   }
+   pool->tasks[(pool->head + pool->count) % pool->cap].run = run;
+   pool->tasks[(pool->head + pool->count) % pool->cap].arg = arg;
+   pool->count++;
+   pthread_cond_signal(&pool->ready);
+   pthread_mutex_unlock(&pool->mutex);
+   return 0;
+}
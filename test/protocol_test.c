@@ -0,0 +1,113 @@
+/*
+//   Program:             TBD Chat Server Tests
+//   File Name:           protocol_test.c
+//   Authors:             Matthew Owens, Michael Geitz, Shayne Wierbowski
+//   TBDChat is a simple chat client and server using BSD sockets
+//   Copyright (C) 2014 Michael Geitz Matthew Owens Shayne Wierbowski
+//
+//   This program is free software; you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation; either version 2 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License along
+//   with this program; if not, write to the Free Software Foundation, Inc.,
+//   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+#include "../server/chat_server.h"
+
+/*
+ *Checks of the server's protocol decoding.  Each failed check prints a line
+ *on stderr and the exit status is the number of failures.
+ */
+static int failures = 0;
+
+
+/* Report a failed check */
+static void check(int ok, char *what) {
+   if (!ok) {
+      fprintf(stderr, "FAIL: %s\n", what);
+      failures++;
+   }
+}
+
+
+/* A client's framed message is decoded with the client's names */
+static void test_client_frame(void) {
+   char out[MAX_FRAME];
+   packet pkt, in;
+   int len;
+
+   memset(&pkt, 0, sizeof(pkt));
+   pkt.options = DEFAULT_ROOM;
+   strcpy(pkt.username, "alice");
+   strcpy(pkt.realname, "Alice");
+   strcpy(pkt.buf, "hello");
+   len = encode_packet(PROTO_FRAMED, &pkt, out);
+   check(decode_request(PROTO_FRAMED, out, len, &in) == len, "client frame decodes");
+   check(strcmp(in.username, "alice") == 0, "client frame keeps its username");
+   check(strcmp(in.buf, "hello") == 0, "client frame keeps its text");
+}
+
+
+/* A client frame carrying FRAME_SERVER is read without names, never as from SERVER */
+static void test_spoofed_server_frame(void) {
+   char out[MAX_FRAME];
+   packet pkt, in;
+   int len;
+
+   memset(&pkt, 0, sizeof(pkt));
+   pkt.options = DEFAULT_ROOM;
+   strcpy(pkt.buf, "Server shutting down, log in at evil.example");
+   len = encode_packet(PROTO_FRAMED, &pkt, out);
+   check(out[7] & FRAME_SERVER, "nameless frame is flagged as the server's");
+   check(decode_request(PROTO_FRAMED, out, len, &in) == len, "client frame with FRAME_SERVER decodes");
+   check(strcmp(in.username, SERVER_NAME) != 0, "client frame is not attributed to SERVER");
+   check(in.username[0] == '\0' && in.realname[0] == '\0', "client frame with FRAME_SERVER has no names");
+   check(strcmp(in.buf, pkt.buf) == 0, "client frame with FRAME_SERVER keeps its text");
+   // The server's own frames, as kept in history, still decode
+   check(decode_packet(PROTO_FRAMED, out, len, &in) == len, "server frame decodes");
+   check(strcmp(in.username, SERVER_NAME) == 0, "server frame is attributed to SERVER");
+}
+
+
+/* A room message whose room names a command is malformed, whatever its length */
+static void test_command_room_frame(void) {
+   char out[MAX_FRAME];
+   packet pkt, in;
+   int len;
+
+   memset(&pkt, 0, sizeof(pkt));
+   pkt.options = DEFAULT_ROOM;
+   strcpy(pkt.username, "mallory");
+   strcpy(pkt.realname, "Mallory");
+   memset(pkt.buf, 'A', 900);
+   len = encode_packet(PROTO_FRAMED, &pkt, out);
+   check(decode_request(PROTO_FRAMED, out, len, &in) == len, "long room message decodes");
+   check(strlen(in.buf) == 900, "long room message keeps its text");
+   // Point the same frame's room field at LOGIN
+   out[8] = out[9] = out[10] = 0;
+   out[11] = LOGIN;
+   check(decode_request(PROTO_FRAMED, out, len, &in) == -1, "long room message to LOGIN is malformed");
+   out[11] = REGISTER;
+   check(decode_request(PROTO_FRAMED, out, len, &in) == -1, "long room message to REGISTER is malformed");
+   out[11] = SETPASS;
+   check(decode_request(PROTO_FRAMED, out, len, &in) == -1, "long room message to SETPASS is malformed");
+   // Rooms past INT_MAX would turn negative as an option
+   memset(out + 8, 0xff, 4);
+   check(decode_request(PROTO_FRAMED, out, len, &in) == -1, "room message to a negative room is malformed");
+}
+
+
+int main(void) {
+   test_client_frame();
+   test_spoofed_server_frame();
+   test_command_room_frame();
+   if (failures == 0) { printf("All protocol tests passed.\n"); }
+   return failures;
+}